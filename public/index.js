@@ -121,74 +121,91 @@ function changeNextDelay() {
     setNextDelay(nextDelay)
 }
 
-var policiesreq = new XMLHttpRequest();
-policiesreq.open("GET", "/api/policies", true); // true for asynchronous 
-policiesreq.onreadystatechange = function() { 
-    if (policiesreq.readyState == 4 && policiesreq.status == 200)
+// The policies and the settings in one round trip
+var loadreq = new XMLHttpRequest();
+loadreq.open("POST", "/api/batch", true); // true for asynchronous 
+loadreq.setRequestHeader("Content-Type", "application/json");
+loadreq.onreadystatechange = function() { 
+    if (loadreq.readyState == 4 && loadreq.status == 200)
     {
+        const [policiesres, settingsres] = JSON.parse(loadreq.responseText);
+        if (policiesres.status != 200 || settingsres.status != 200)
+            return;
         var dropDownListNow = document.getElementById("dropDownListNow");
         var dropDownListLater = document.getElementById("dropDownListLater");
-        policylist = JSON.parse(policiesreq.responseText);
-        for (const policy of policylist) {
+        for (const policy of policiesres.body) {
             policies[policy.index] = policy;
 	        console.log(policy.index + ": " + policy);
             dropDownListNow.insertAdjacentHTML('beforeend', 
                 '<a onclick="activatePolicy(' + policy.index + ')">' +
-                '<i class="wi ' + policy.icon + '"></i>' + policy.label + '</a>');
+                '<i class="wi ' + policy.icon + '"></i>' + policy.label +
+                '<span class="shadow" id="shadow' + policy.index + '"></span></a>');
             dropDownListLater.insertAdjacentHTML('beforeend', 
                 '<a onclick="setNextPolicy(' + policy.index + ')">' +
                 '<i class="wi ' + policy.icon + '"></i>' + policy.label + '</a>');
         }
-        
-        var settingsreq = new XMLHttpRequest();
-        settingsreq.open("GET", "/api/settings", true); // true for asynchronous 
-        settingsreq.onreadystatechange = function() { 
-            if (settingsreq.readyState == 4 && settingsreq.status == 200)
-            {
-                settings = JSON.parse(settingsreq.responseText);
-                displayPolicy();
-            }
-        }
-        settingsreq.send(null);
+        settings = settingsres.body;
+        displayPolicy();
     }
 };
-policiesreq.send(null);
-
-
-function refresh() {
-    var req = new XMLHttpRequest();
-    req.onreadystatechange = function() { 
-        if (req.readyState == 4)
-        {
-            if (req.status == 200)
-                document.getElementById("curcap").innerHTML = req.responseText;
-            setTimeout(refresh, 1000);
-        }
+loadreq.send(JSON.stringify([{method: "GET", name: "policies"}, {method: "GET", name: "settings"}]));
+
+
+// Apply a JSON merge patch (RFC 7396) as sent by the server in its events
+function mergePatch(target, patch) {
+    if (patch === null || typeof patch !== 'object' || Array.isArray(patch))
+        return patch;
+    if (target === null || typeof target !== 'object' || Array.isArray(target))
+        target = {};
+    for (const key in patch) {
+        if (patch[key] === null)
+            delete target[key];
+        else
+            target[key] = mergePatch(target[key], patch[key]);
     }
-    req.open("GET", "/api/curcap", true); // true for asynchronous 
-    req.send(null);
+    return target;
+}
+
+var monitor = {};
+var events = new EventSource("/api/events");
+events.onopen = function() {
+    monitor = {}; // the server starts with the complete state
 }
-refresh();
+events.addEventListener("monitor", function(event) {
+    monitor = mergePatch(monitor, JSON.parse(event.data));
+    document.getElementById("curcap").innerHTML = monitor.curcap;
+});
+events.addEventListener("p1status", function(event) {
+    if (JSON.parse(event.data))
+        document.getElementById("p1status").innerHTML = ""
+    else
+        document.getElementById("p1status").innerHTML = "<br/>Niet verbonden met laadpunt"
+});
+events.addEventListener("settings", function(event) {
+    settings = mergePatch(settings, JSON.parse(event.data));
+    if (policies[settings.active_policy] && policies[settings.next_policy])
+        displayPolicy();
+});
+
+
 
-function refreshP1Status() {
+function refreshShadow() {
     var req = new XMLHttpRequest();
     req.onreadystatechange = function() { 
         if (req.readyState == 4)
         {
             if (req.status == 200)
             {
-                var p1status = JSON.parse(req.responseText)
-                if (p1status) 
-                    document.getElementById("p1status").innerHTML = ""
-                else
-                    document.getElementById("p1status").innerHTML = "<br/>Niet verbonden met laadpunt"
+                for (const shadow of JSON.parse(req.responseText)) {
+                    const span = document.getElementById("shadow" + shadow.index);
+                    if (span)
+                        span.innerHTML = Math.round(shadow.power) + " W nu, " + Math.round(shadow.average_power) + " W gemiddeld";
+                }
             }
-            setTimeout(refreshP1Status, 2500);
+            setTimeout(refreshShadow, 5000);
         }
     }
-    req.open("GET", "/api/p1status", true); // true for asynchronous 
+    req.open("GET", "/api/shadow", true); // true for asynchronous 
     req.send(null);
 }
-refreshP1Status();
-
-
+refreshShadow();
@@ -11,24 +11,36 @@ function changeParam(input) {
     req.send(JSON.stringify(params));
 }
 
+// Apply a JSON merge patch (RFC 7396) as sent by the server in its events
+function mergePatch(target, patch) {
+    if (patch === null || typeof patch !== 'object' || Array.isArray(patch))
+        return patch;
+    if (target === null || typeof target !== 'object' || Array.isArray(target))
+        target = {};
+    for (const key in patch) {
+        if (patch[key] === null)
+            delete target[key];
+        else
+            target[key] = mergePatch(target[key], patch[key]);
+    }
+    return target;
+}
+
+var output = {};
+
 function refreshOutput() {
-    var req = new XMLHttpRequest();
-    req.onreadystatechange = function() { 
-        if (req.readyState == 4)
-        {
-            if (req.status == 200)
-            {
-                output = JSON.parse(req.responseText)
-                for (const key in output) {
-                    var td = document.getElementById(key)
-                    td.innerText = output[key]
-                }
-            }
-            setTimeout(refreshOutput, 1000);
-        }
+    var events = new EventSource("/api/events");
+    events.onopen = function() {
+        output = {}; // the server starts with the complete state
     }
-    req.open("GET", "/api/simulator/output", true); // true for asynchronous 
-    req.send(null);
+    events.addEventListener("simulator", function(event) {
+        output = mergePatch(output, JSON.parse(event.data));
+        for (const key in output) {
+            var td = document.getElementById(key)
+            if (td)
+                td.innerText = output[key]
+        }
+    });
 }
 
 var loadParamsReq = new XMLHttpRequest();
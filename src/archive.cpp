@@ -0,0 +1,673 @@
+#include "config.h"
+#include "core.h"
+#include "logf.h"
+#include "mutex_protected.h"
+#include "timeseries.h"
+#include "www.h"
+
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace asio = boost::asio;
+
+namespace
+{
+
+using timeseries::fields;
+
+config::param<bool> enable{"archive.enable", false};
+config::param<std::string> file{"archive.file", "archive.p1ts"};
+config::param<int> block_size{"archive.block_size", 3600}; // samples per block, i.e. per write to disk
+
+/*
+ * The archive is a single file of blocks that is only ever appended to. Each block holds the samples of block_size
+ * ticks, column by column, so that a query only decodes the fields it asks for:
+ *
+ *     header   magic, size of the payload, time of the first and the last sample, number of samples and of columns,
+ *              CRC-32 of the payload, version of the format
+ *     payload  per column a uint32 with its size in bits, followed by the bits, padded to a whole number of bytes.
+ *              The first column holds the times in ms, the next ones each field of timeseries::fields as float.
+ *
+ * Compression as in Gorilla (Pelkonen et al., 2015): times by their delta of delta, which is mostly 0, and values by
+ * the XOR with the previous one, which is 0 for a value that did not change and has only a few meaningful bits for
+ * one that changed a little. Everything is in the byte order of the host.
+ */
+constexpr uint32_t magic = 0x54503150; // "P1PT" on a little endian host
+constexpr uint32_t archive_version = 1; // of the layout of a block; 0 is the same, from before the header had a version
+constexpr uint32_t column_count = 1 + fields.size(); // changes with timeseries::fields
+
+struct header
+{
+    uint32_t magic;
+    uint32_t size; // bytes of payload after the header
+    int64_t first; // ms since the epoch
+    int64_t last;
+    uint32_t count;
+    uint32_t columns;
+    uint32_t crc;
+    uint32_t version;
+
+    // whether this version of p1faker can read the block
+    bool compatible() const { return (version == 0 or version == archive_version) and columns == column_count; }
+
+    // whether the size is possible for the number of samples, as a check that a header past the end is not garbage
+    bool plausible() const
+    {
+        // the worst cases of the encoders: 68 bits per time and 44 bits per value after the first
+        std::size_t time_bits = 64 + std::size_t(count) * 68, value_bits = 32 + std::size_t(count) * 44;
+        return count > 0 and size <= columns * sizeof(uint32_t) + (time_bits + 7) / 8 + (columns - 1) * ((value_bits + 7) / 8);
+    }
+};
+
+class bit_writer
+{
+public:
+    // writes the lowest bits of value, most significant first
+    void write(uint64_t value, int bits)
+    {
+        while (bits > 0) {
+            if (m_bits % 8 == 0)
+                m_data.push_back(0);
+            int room = 8 - m_bits % 8, n = std::min(room, bits);
+            m_data.back() |= uint8_t(((value >> (bits - n)) & ((1u << n) - 1)) << (room - n));
+            m_bits += n;
+            bits -= n;
+        }
+    }
+    const std::vector<uint8_t>& data() const { return m_data; }
+    std::size_t bits() const { return m_bits; }
+    void clear() { m_data.clear(); m_bits = 0; }
+
+private:
+    std::vector<uint8_t> m_data;
+    std::size_t m_bits = 0;
+};
+
+class bit_reader
+{
+public:
+    bit_reader(const uint8_t* data, std::size_t bits) : m_data(data), m_bits(bits) {}
+
+    uint64_t read(int bits)
+    {
+        if (m_pos + bits > m_bits)
+            throw std::runtime_error("Corrupt block in archive");
+        uint64_t value = 0;
+        while (bits > 0) {
+            int left = 8 - m_pos % 8, n = std::min(left, bits);
+            value = (value << n) | ((m_data[m_pos / 8] >> (left - n)) & ((1u << n) - 1));
+            m_pos += n;
+            bits -= n;
+        }
+        return value;
+    }
+    bool read_bit() { return read(1); }
+
+private:
+    const uint8_t* m_data;
+    std::size_t m_bits;
+    std::size_t m_pos = 0;
+};
+
+struct time_encoder
+{
+    void add(int64_t t)
+    {
+        if (count++ == 0) {
+            out.write(uint64_t(t), 64);
+        } else {
+            int64_t delta = t - prev, dod = delta - prev_delta;
+            if (dod == 0) out.write(0b0, 1);
+            else if (dod >= -63 and dod <= 64) { out.write(0b10, 2); out.write(uint64_t(dod + 63), 7); }
+            else if (dod >= -255 and dod <= 256) { out.write(0b110, 3); out.write(uint64_t(dod + 255), 9); }
+            else if (dod >= -2047 and dod <= 2048) { out.write(0b1110, 4); out.write(uint64_t(dod + 2047), 12); }
+            else { out.write(0b1111, 4); out.write(uint64_t(dod), 64); }
+            prev_delta = delta;
+        }
+        prev = t;
+    }
+    void clear() { *this = {}; }
+
+    bit_writer out;
+    std::size_t count = 0;
+    int64_t prev = 0;
+    int64_t prev_delta = 0;
+};
+
+struct time_decoder
+{
+    int64_t next()
+    {
+        if (count++ == 0)
+            return prev = int64_t(in.read(64));
+        int64_t dod;
+        if (not in.read_bit()) dod = 0;
+        else if (not in.read_bit()) dod = int64_t(in.read(7)) - 63;
+        else if (not in.read_bit()) dod = int64_t(in.read(9)) - 255;
+        else if (not in.read_bit()) dod = int64_t(in.read(12)) - 2047;
+        else dod = int64_t(in.read(64));
+        prev_delta += dod;
+        return prev += prev_delta;
+    }
+
+    bit_reader in;
+    std::size_t count = 0;
+    int64_t prev = 0;
+    int64_t prev_delta = 0;
+};
+
+struct value_encoder
+{
+    void add(float value)
+    {
+        auto bits = std::bit_cast<uint32_t>(value);
+        if (count++ == 0) {
+            out.write(bits, 32);
+        } else if (auto x = bits ^ prev; x == 0) {
+            out.write(0b0, 1);
+        } else {
+            int leading = std::min(std::countl_zero(x), 31), trailing = std::countr_zero(x);
+            if (leading >= prev_leading and trailing >= prev_trailing) {
+                // the meaningful bits fit in the window of the previous value
+                out.write(0b10, 2);
+                out.write(x >> prev_trailing, 32 - prev_leading - prev_trailing);
+            } else {
+                out.write(0b11, 2);
+                out.write(leading, 5);
+                out.write(32 - leading - trailing - 1, 5);
+                out.write(x >> trailing, 32 - leading - trailing);
+                prev_leading = leading;
+                prev_trailing = trailing;
+            }
+        }
+        prev = bits;
+    }
+    void clear() { *this = {}; }
+
+    bit_writer out;
+    std::size_t count = 0;
+    uint32_t prev = 0;
+    int prev_leading = 32; // no window yet
+    int prev_trailing = 32;
+};
+
+struct value_decoder
+{
+    float next()
+    {
+        if (count++ == 0)
+            return std::bit_cast<float>(prev = in.read(32));
+        if (in.read_bit()) {
+            if (in.read_bit()) {
+                leading = in.read(5);
+                trailing = 32 - leading - (in.read(5) + 1);
+            }
+            prev ^= uint32_t(in.read(32 - leading - trailing)) << trailing;
+        }
+        return std::bit_cast<float>(prev);
+    }
+
+    bit_reader in;
+    std::size_t count = 0;
+    uint32_t prev = 0;
+    int leading = 0;
+    int trailing = 0;
+};
+
+// A block in the file
+struct block
+{
+    int64_t first;
+    int64_t last;
+    uint64_t offset;
+};
+
+// The columns of a block, compressed
+struct columns
+{
+    std::size_t count = 0;
+    std::pair<const uint8_t*, std::size_t> time; // data and size in bits
+    std::array<std::pair<const uint8_t*, std::size_t>, fields.size()> values;
+
+    // Calls f(time, values) for each sample, but only decodes the selected fields
+    template<typename F>
+    void decode(const std::vector<std::size_t>& selected, F&& f) const
+    {
+        time_decoder t{{time.first, time.second}};
+        std::array<std::optional<value_decoder>, fields.size()> v;
+        for (auto i : selected)
+            v[i].emplace(value_decoder{{values[i].first, values[i].second}});
+        std::array<float, fields.size()> sample;
+        for (std::size_t n = 0; n < count; n++) {
+            auto ms = t.next();
+            for (auto i : selected)
+                sample[i] = v[i]->next();
+            f(ms, sample);
+        }
+    }
+
+    // Parses the payload of a block as found in the file
+    static columns parse(const uint8_t* payload, const header& h)
+    {
+        columns result;
+        result.count = h.count;
+        const uint8_t* pos = payload;
+        const uint8_t* end = payload + h.size;
+        auto next = [&] {
+            uint32_t bits;
+            if (end - pos < ptrdiff_t(sizeof bits))
+                throw std::runtime_error("Corrupt block in archive");
+            std::memcpy(&bits, pos, sizeof bits);
+            pos += sizeof bits;
+            if (std::size_t(end - pos) < (bits + 7) / 8)
+                throw std::runtime_error("Corrupt block in archive");
+            std::pair<const uint8_t*, std::size_t> column{pos, bits};
+            pos += (bits + 7) / 8;
+            return column;
+        };
+        result.time = next();
+        for (auto& column : result.values)
+            column = next();
+        return result;
+    }
+};
+
+struct query
+{
+    std::optional<int64_t> from; // s since the epoch, a day before to by default
+    std::optional<int64_t> to; // s since the epoch, now by default
+    std::size_t points = 500; // maximum number of points per field
+    std::string fields; // comma separated, all by default
+};
+
+void from_json(const nlohmann::json& j, query& q)
+{
+    if (j.contains("from")) q.from = j.at("from").get<int64_t>();
+    if (j.contains("to")) q.to = j.at("to").get<int64_t>();
+    q.points = std::clamp<std::size_t>(j.value("points", q.points), 3, 10000);
+    q.fields = j.value("fields", q.fields);
+}
+
+// Read-only mapping of a part of the file, such as a block, so that the address space does not limit the size of
+// the file on a 32-bit system
+struct mapping
+{
+    mapping(int fd, uint64_t offset, std::size_t size)
+    {
+        if (size == 0)
+            return;
+        static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+        auto start = offset - offset % page_size;
+        m_size = size + (offset - start);
+        auto ptr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, off_t(start));
+        if (ptr == MAP_FAILED)
+            throw std::system_error{errno, std::system_category(), "mmap"};
+        m_base = static_cast<const uint8_t*>(ptr);
+        data = m_base + (offset - start);
+    }
+    mapping(const mapping&) = delete;
+    ~mapping() { if (m_base) munmap(const_cast<uint8_t*>(m_base), m_size); }
+
+    const uint8_t* data = nullptr;
+
+private:
+    const uint8_t* m_base = nullptr;
+    std::size_t m_size = 0;
+};
+
+struct archive : core::consumer
+{
+    archive() : core::consumer("archive")
+    {
+        open();
+        try {
+            if (not scan()) {
+                rotate();
+                open();
+                scan();
+            }
+        } catch (...) {
+            ::close(m_fd);
+            throw;
+        }
+        m_thread = std::thread{[this] { m_ioc.run(); }};
+    }
+
+    ~archive()
+    {
+        flush(*m_state.lock());
+        m_work.reset(); // the writer returns once the blocks that were handed to it are written
+        m_thread.join();
+        ::close(m_fd);
+    }
+
+    void open()
+    {
+        m_fd = ::open(file->c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (m_fd < 0)
+            throw std::system_error{errno, std::system_category(), "open " + file.get()};
+    }
+
+    // Moves a file that was written in another format, or for other fields, out of the way, to file.1 or the first
+    // number that is free
+    void rotate()
+    {
+        ::close(m_fd);
+        std::string aside;
+        for (int n = 1; aside.empty() or access(aside.c_str(), F_OK) == 0; n++)
+            aside = str(boost::format("%s.%d") % file % n);
+        if (rename(file->c_str(), aside.c_str()) < 0)
+            throw std::system_error{errno, std::system_category(), "rename " + file.get()};
+        logfwarn("Moved %s to %s, because it was written in another format or for other fields", file, aside);
+    }
+
+    /*
+     * Builds the index from the block headers only. Cuts off the last block if it was not completely written, as after
+     * a crash, but refuses to touch anything else that is not a valid block: the data before it is worth more. Returns
+     * false if the file is in a format or for fields that this version of p1faker cannot read.
+     */
+    bool scan()
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        struct stat st;
+        if (fstat(m_fd, &st) < 0)
+            throw std::system_error{errno, std::system_category(), "stat " + file.get()};
+        uint64_t file_size = st.st_size;
+        auto state = m_state.lock();
+        uint64_t offset = 0;
+        std::size_t samples = 0;
+        while (offset < file_size) {
+            header h;
+            if (file_size - offset < sizeof h)
+                break; // torn
+            if (pread(m_fd, &h, sizeof h, off_t(offset)) != ssize_t(sizeof h))
+                throw std::system_error{errno, std::system_category(), "read " + file.get()};
+            if (h.magic != magic)
+                throw std::runtime_error(str(boost::format("%s has no valid block at offset %d") % file % offset));
+            if (not h.compatible()) {
+                if (offset == 0)
+                    return false;
+                throw std::runtime_error(str(boost::format("%s has a block of version %d with %d columns at offset %d")
+                        % file % h.version % h.columns % offset));
+            }
+            auto end = offset + sizeof h + h.size;
+            if (end > file_size) {
+                if (h.plausible())
+                    break; // torn
+                throw std::runtime_error(str(boost::format("%s has an invalid block at offset %d") % file % offset));
+            }
+            // a crash can only have damaged the last block, so do not spend the time on the others
+            if (end == file_size) {
+                mapping map{m_fd, offset + sizeof h, h.size};
+                if (crc32(0, map.data, h.size) != h.crc)
+                    break; // torn
+            }
+            state->blocks.push_back(block{h.first, h.last, offset});
+            samples += h.count;
+            offset = end;
+        }
+        if (offset < file_size) {
+            logfwarn("Discarding the last %d bytes of %s, a block that was not completely written", file_size - offset, file);
+            if (ftruncate(m_fd, off_t(offset)) < 0)
+                logferror("Failed to truncate %s: %s", file, strerror(errno));
+        }
+        state->size = offset;
+        logfinfo("Indexed %d blocks with %d samples in %s (%d bytes) in %s", state->blocks.size(), samples, file, offset,
+                std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0));
+        return true;
+    }
+
+    void handle(const core::budget& b, const core::situation& sit) override
+    {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        auto state = m_state.lock();
+        if (state->time.count == 0)
+            state->first = ms;
+        state->time.add(ms);
+        for (std::size_t i = 0; i < fields.size(); i++)
+            state->values[i].add(float(fields[i].get(b, sit)));
+        if (state->time.count >= std::size_t(std::max(1, block_size.get())))
+            flush(*state);
+    }
+
+    struct state
+    {
+        std::vector<block> blocks;
+        uint64_t size = 0; // of the file
+        std::deque<std::shared_ptr<const std::vector<uint8_t>>> queued; // blocks handed to the writer, not on disk yet
+        // the block that is being filled
+        int64_t first = 0;
+        time_encoder time;
+        std::array<value_encoder, fields.size()> values;
+    };
+
+    // Encodes the samples so far as a block and hands it to the writer, so that the tick does not wait for the disk
+    void flush(state& s)
+    {
+        if (s.time.count == 0)
+            return;
+        std::vector<uint8_t> buffer(sizeof(header));
+        auto append = [&](const bit_writer& column) {
+            uint32_t bits = column.bits();
+            buffer.insert(buffer.end(), reinterpret_cast<const uint8_t*>(&bits), reinterpret_cast<const uint8_t*>(&bits + 1));
+            buffer.insert(buffer.end(), column.data().begin(), column.data().end());
+        };
+        append(s.time.out);
+        for (auto& v : s.values)
+            append(v.out);
+        header h{magic, uint32_t(buffer.size() - sizeof(header)), s.first, s.time.prev, uint32_t(s.time.count),
+                column_count, 0, archive_version};
+        h.crc = crc32(0, buffer.data() + sizeof h, h.size);
+        std::memcpy(buffer.data(), &h, sizeof h);
+
+        auto queued = std::make_shared<const std::vector<uint8_t>>(std::move(buffer));
+        s.queued.push_back(queued);
+        asio::post(m_ioc, [this, queued] { write(*queued); });
+        s.time.clear();
+        for (auto& v : s.values)
+            v.clear();
+    }
+
+    // Appends a block with a single write, on the writer thread, which is the only one that changes the file
+    void write(const std::vector<uint8_t>& buffer)
+    {
+        header h;
+        std::memcpy(&h, buffer.data(), sizeof h);
+        auto size = m_state.lock()->size;
+
+        std::size_t written = 0;
+        while (written < buffer.size()) {
+            auto n = ::write(m_fd, buffer.data() + written, buffer.size() - written);
+            if (n < 0 and errno == EINTR)
+                continue;
+            if (n < 0) {
+                logferror("Failed to write %d samples to %s: %s", h.count, file, strerror(errno));
+                // a partial block would hide everything after it, so cut it off again
+                if (written > 0 and ftruncate(m_fd, size) < 0)
+                    logferror("Failed to truncate %s: %s", file, strerror(errno));
+                break;
+            }
+            written += n;
+        }
+        bool ok = written == buffer.size();
+        if (ok)
+            fdatasync(m_fd);
+
+        auto s = m_state.lock();
+        s->queued.pop_front();
+        if (ok) {
+            s->blocks.push_back(block{h.first, h.last, size});
+            s->size += buffer.size();
+            logfdebug("Archived %d samples in %d bytes", h.count, buffer.size());
+        }
+    }
+
+    void get(const query& q, www::json_writer& out) const
+    {
+        auto now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        auto to = q.to.value_or(now);
+        auto from = q.from.value_or(to - 86400);
+        if (from > to)
+            throw std::invalid_argument("from is after to");
+        int64_t from_ms = from * 1000, to_ms = to * 1000 + 999;
+
+        std::vector<std::size_t> selected;
+        for (std::size_t i = 0; i < fields.size(); i++)
+            if (q.fields.empty() or timeseries::contains(q.fields, fields[i].name))
+                selected.push_back(i);
+
+        // Take what is needed under the lock: the blocks on disk do not change anymore, so they are decoded without
+        // holding up the control loop
+        std::vector<block> blocks;
+        std::vector<std::shared_ptr<const std::vector<uint8_t>>> queued;
+        bit_writer pending_time;
+        std::array<bit_writer, fields.size()> pending_values;
+        std::size_t pending_count;
+        {
+            auto s = m_state.lock();
+            auto begin = std::lower_bound(s->blocks.begin(), s->blocks.end(), from_ms, [](const block& b, int64_t t) { return b.last < t; });
+            for (auto it = begin; it != s->blocks.end() and it->first <= to_ms; ++it)
+                blocks.push_back(*it);
+            queued.assign(s->queued.begin(), s->queued.end());
+            pending_count = s->time.count;
+            if (pending_count > 0 and s->first <= to_ms and s->time.prev >= from_ms) {
+                pending_time = s->time.out;
+                for (auto i : selected)
+                    pending_values[i] = s->values[i].out;
+            } else {
+                pending_count = 0;
+            }
+        }
+
+        // Aggregate into many more buckets than points first, so that memory does not depend on the range
+        const std::size_t bucket_count = 8 * q.points;
+        auto bucket_of = [&](int64_t ms) {
+            return std::min(bucket_count - 1, std::size_t((ms - from_ms) * double(bucket_count) / double(to_ms + 1 - from_ms)));
+        };
+        std::vector<int64_t> bucket_time(bucket_count, -1);
+        std::vector<std::array<timeseries::accumulator, fields.size()>> buckets(bucket_count);
+        std::size_t samples = 0;
+        auto add = [&](int64_t ms, const std::array<float, fields.size()>& values) {
+            if (ms < from_ms or ms > to_ms)
+                return;
+            auto b = bucket_of(ms);
+            if (bucket_time[b] < 0)
+                bucket_time[b] = ms;
+            for (auto i : selected)
+                buckets[b][i].add(values[i]);
+            samples++;
+        };
+
+        for (auto& b : blocks) {
+            header h;
+            if (pread(m_fd, &h, sizeof h, off_t(b.offset)) != ssize_t(sizeof h))
+                throw std::system_error{errno, std::system_category(), "read " + file.get()};
+            mapping map{m_fd, b.offset + sizeof h, h.size};
+            columns::parse(map.data, h).decode(selected, add);
+        }
+        for (auto& buffer : queued) {
+            header h;
+            std::memcpy(&h, buffer->data(), sizeof h);
+            if (h.first <= to_ms and h.last >= from_ms)
+                columns::parse(buffer->data() + sizeof h, h).decode(selected, add);
+        }
+        if (pending_count > 0) {
+            columns c;
+            c.count = pending_count;
+            c.time = {pending_time.data().data(), pending_time.bits()};
+            for (auto i : selected)
+                c.values[i] = {pending_values[i].data().data(), pending_values[i].bits()};
+            c.decode(selected, add);
+        }
+
+        std::vector<std::size_t> used; // the buckets that have samples
+        for (std::size_t b = 0; b < bucket_count; b++)
+            if (bucket_time[b] >= 0)
+                used.push_back(b);
+
+        out.begin_object();
+        out.key("from"); out.value(from);
+        out.key("to"); out.value(to);
+        out.key("samples"); out.value(int64_t(samples));
+        out.key("fields");
+        out.begin_object();
+        for (auto f : selected) {
+            auto at = [&](std::size_t i) { return buckets[used[i]][f].get(); };
+            auto picks = timeseries::lttb(used.size(), q.points,
+                    [&](std::size_t i) { return double(bucket_time[used[i]]); },
+                    [&](std::size_t i) { return double(at(i).avg); });
+            out.key(fields[f].name);
+            out.begin_object();
+            out.key("time");
+            out.begin_array();
+            for (auto& p : picks)
+                out.value(bucket_time[used[p.index]] / 1000);
+            out.end_array();
+            out.key("avg");
+            out.begin_array();
+            for (auto& p : picks)
+                out.value(at(p.index).avg);
+            out.end_array();
+            out.key("min");
+            out.begin_array();
+            for (auto& p : picks) {
+                float lo = NAN;
+                for (auto i = p.begin; i < p.end; i++)
+                    lo = std::fmin(lo, at(i).min);
+                out.value(lo);
+            }
+            out.end_array();
+            out.key("max");
+            out.begin_array();
+            for (auto& p : picks) {
+                float hi = NAN;
+                for (auto i = p.begin; i < p.end; i++)
+                    hi = std::fmax(hi, at(i).max);
+                out.value(hi);
+            }
+            out.end_array();
+            out.end_object();
+        }
+        out.end_object();
+        out.end_object();
+    }
+
+    int m_fd;
+    mutable mutex_protected<state> m_state;
+    www::rpc m_rpc = www::rpc::stream<query>("archive", [this](const query& q, www::json_writer& out) {
+        get(q, out);
+    });
+
+    // the writer
+    asio::io_context m_ioc;
+    asio::executor_work_guard<asio::io_context::executor_type> m_work = asio::make_work_guard(m_ioc);
+    std::thread m_thread;
+};
+
+std::optional<archive> impl;
+int _ = core::at_startup([] {
+    try {
+        if (enable) impl.emplace();
+    } catch (std::exception& e) {
+        logferror("Failed to open archive: %s", e.what());
+    }
+});
+
+} // anonymous namespace
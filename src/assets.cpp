@@ -0,0 +1,256 @@
+#include "assets.h"
+#include "config.h"
+#include "logf.h"
+#include "mutex_protected.h"
+
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/algorithm/string/trim.hpp>
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace asio = boost::asio;
+namespace fs = std::filesystem;
+
+using namespace assets;
+
+namespace {
+
+// function-local, because the www server loads the cache during static initialization
+const std::string& doc_root() {
+    static config::param<std::string> doc_root{"www.doc_root", "public"};
+    return doc_root.get();
+}
+
+int max_age() {
+    static config::param<int> max_age{"www.max_age", 86400}; // s that fonts and images may be cached without revalidation
+    return max_age.get();
+}
+
+// Return a reasonable mime type based on the extension of a file.
+std::string_view mime_type(std::string_view path) {
+    using boost::algorithm::iends_with;
+    if (iends_with(path, ".html"))  return "text/html";
+    if (iends_with(path, ".css"))   return "text/css";
+    if (iends_with(path, ".js"))    return "text/javascript";
+    if (iends_with(path, ".json"))  return "application/json";
+    if (iends_with(path, ".png"))   return "image/png";
+    if (iends_with(path, ".jpg"))   return "image/jpeg";
+    if (iends_with(path, ".ico"))   return "image/vnd.microsoft.icon";
+    if (iends_with(path, ".svg"))   return "image/svg+xml";
+    if (iends_with(path, ".woff"))  return "font/woff";
+    if (iends_with(path, ".woff2")) return "font/woff2";
+    if (iends_with(path, ".ttf"))   return "font/ttf";
+    if (iends_with(path, ".otf"))   return "font/otf";
+    if (iends_with(path, ".eot"))   return "application/vnd.ms-fontobject";
+    return "application/octet-stream";
+}
+
+// Formats that are not compressed already
+bool compressible(std::string_view mime_type) {
+    return mime_type.starts_with("text/") or mime_type == "application/json" or mime_type == "image/svg+xml"
+        or mime_type == "image/vnd.microsoft.icon" or mime_type == "font/ttf" or mime_type == "font/otf"
+        or mime_type == "application/vnd.ms-fontobject";
+}
+
+std::string etag(std::string_view data) {
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (unsigned char c : data)
+        hash = (hash ^ c) * 1099511628211ull;
+    return str(boost::format("\"%016x\"") % hash);
+}
+
+std::shared_ptr<const std::string> read_file(const fs::path& path) {
+    std::ifstream fin{path, std::ios::binary};
+    if (not fin.is_open())
+        return nullptr;
+    std::ostringstream data;
+    data << fin.rdbuf();
+    return std::make_shared<const std::string>(std::move(data).str());
+}
+
+std::shared_ptr<const std::string> gzip(const std::string& data) {
+    z_stream zs = {};
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return nullptr;
+    std::string result(deflateBound(&zs, data.size()), '\0');
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs.avail_in = data.size();
+    zs.next_out = reinterpret_cast<Bytef*>(result.data());
+    zs.avail_out = result.size();
+    int rc = deflate(&zs, Z_FINISH);
+    result.resize(zs.total_out);
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END)
+        return nullptr;
+    return std::make_shared<const std::string>(std::move(result));
+}
+
+struct cache {
+    static auto& instance() {
+        static mutex_protected<cache, std::shared_mutex> instance;
+        return instance;
+    }
+
+    std::map<std::string, std::shared_ptr<const asset>, std::less<>> assets; // by path relative to doc_root, starting with '/'
+
+    cache() {
+        std::error_code ec;
+        for (auto it = fs::recursive_directory_iterator{doc_root(), ec}; it != fs::recursive_directory_iterator{}; it.increment(ec))
+            if (it->is_regular_file()) {
+                auto [key, a] = read(it->path());
+                store(key, std::move(a));
+            }
+        if (ec)
+            logferror("Failed to scan %s: %s", doc_root(), ec.message());
+        std::size_t size = 0;
+        for (auto& [path, a] : assets)
+            for (auto& v : a->variants)
+                size += v.body->size();
+        logfinfo("Cached %d files from %s (%d bytes)", assets.size(), doc_root(), size);
+    }
+
+    // Reads the file at the given path and its precompressed variants, without the cache: compressing a file takes
+    // a while, and requests would wait for it under the lock. The asset is null if the file is gone.
+    static std::pair<std::string, std::shared_ptr<const asset>> read(fs::path path) {
+        if (path.extension() == ".gz" or path.extension() == ".br")
+            path.replace_extension();
+        auto key = "/" + path.lexically_relative(doc_root()).generic_string();
+
+        auto body = read_file(path);
+        if (not body)
+            return {key, nullptr};
+        auto a = std::make_shared<asset>();
+        a->mime_type = mime_type(key);
+        a->cache_control = compressible(a->mime_type) and not a->mime_type.starts_with("image/")
+                ? "no-cache" // the UI itself, so that a change shows up immediately: revalidate with the ETag
+                : str(boost::format("public, max-age=%d") % max_age());
+        a->variants.push_back(variant{"", etag(*body), body});
+        for (auto encoding : {"br", "gzip"}) {
+            auto compressed = read_file(path.string() + (encoding == std::string_view{"br"} ? ".br" : ".gz"));
+            if (not compressed and encoding == std::string_view{"gzip"} and compressible(a->mime_type))
+                compressed = gzip(*body);
+            if (compressed and compressed->size() < body->size())
+                a->variants.push_back(variant{encoding, etag(*compressed), compressed});
+        }
+        return {key, std::move(a)};
+    }
+
+    // (Re)places what read() found for a file in the cache
+    void store(const std::string& key, std::shared_ptr<const asset> a) {
+        if (not a) {
+            if (assets.erase(key))
+                logfdebug("Removed %s from cache", key);
+            return;
+        }
+        logfdebug("Cached %s in %d variants", key, a->variants.size());
+        assets[key] = std::move(a);
+    }
+};
+
+// Reloads files from the document root when they change
+struct watcher : std::enable_shared_from_this<watcher> {
+    watcher(asio::io_context& ioc) : m_stream(ioc) {
+        int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0)
+            throw std::system_error{errno, std::system_category(), "inotify_init1"};
+        m_stream.assign(fd);
+        add(doc_root());
+    }
+
+    void add(const fs::path& dir) {
+        int wd = inotify_add_watch(m_stream.native_handle(), dir.c_str(),
+                IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+        if (wd < 0)
+            return logferror("Failed to watch %s: %s", dir, strerror(errno));
+        m_dirs[wd] = dir;
+        std::error_code ec;
+        for (auto& entry : fs::directory_iterator{dir, ec})
+            if (entry.is_directory())
+                add(entry.path());
+    }
+
+    void run() {
+        m_stream.async_read_some(asio::buffer(m_buffer), [self = shared_from_this()](boost::system::error_code ec, std::size_t n) {
+            if (ec)
+                return logferror("Stopped watching %s: %s", doc_root(), ec.message());
+            self->handle(n);
+            self->run();
+        });
+    }
+
+    void handle(std::size_t n) {
+        for (std::size_t pos = 0; pos + sizeof(inotify_event) <= n; ) {
+            auto* event = reinterpret_cast<const inotify_event*>(m_buffer.data() + pos);
+            pos += sizeof(inotify_event) + event->len;
+            auto dir = m_dirs.find(event->wd);
+            if (dir == m_dirs.end() or event->len == 0)
+                continue;
+            auto path = dir->second / event->name;
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                    add(path);
+            } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)) {
+                auto [key, a] = cache::read(path);
+                cache::instance().lock()->store(key, std::move(a));
+            }
+        }
+    }
+
+    asio::posix::stream_descriptor m_stream;
+    std::map<int, fs::path> m_dirs;
+    alignas(inotify_event) std::array<char, 4096> m_buffer;
+};
+
+// Whether the Accept-Encoding header lists the encoding without q=0
+bool accepts(std::string_view accept_encoding, std::string_view encoding) {
+    std::size_t pos = 0;
+    while (pos <= accept_encoding.size()) {
+        auto end = std::min(accept_encoding.find(',', pos), accept_encoding.size());
+        std::string item{accept_encoding.substr(pos, end - pos)};
+        pos = end + 1;
+        boost::trim(item);
+        auto params = item.find(';');
+        std::string token = item.substr(0, params);
+        boost::trim(token);
+        if (not boost::iequals(token, encoding))
+            continue;
+        if (params == std::string::npos)
+            return true;
+        auto q = item.find("q=", params);
+        return q == std::string::npos or std::atof(item.c_str() + q + 2) > 0.0;
+    }
+    return false;
+}
+
+} // anonymous namespace
+
+const variant& asset::select(std::string_view accept_encoding) const {
+    const variant* best = &variants.front();
+    for (auto& v : variants)
+        if (v.body->size() < best->body->size() and accepts(accept_encoding, v.encoding))
+            best = &v;
+    return *best;
+}
+
+std::shared_ptr<const asset> assets::find(std::string_view path) {
+    auto c = cache::instance().lock_shared();
+    auto it = c->assets.find(path);
+    return it == c->assets.end() ? nullptr : it->second;
+}
+
+void assets::watch(asio::io_context& ioc) {
+    cache::instance(); // load on startup rather than on the first request
+    try {
+        std::make_shared<watcher>(ioc)->run();
+    } catch (std::exception& e) {
+        logferror("Failed to watch %s for changes: %s", doc_root(), e.what());
+    }
+}
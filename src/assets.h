@@ -0,0 +1,41 @@
+#ifndef ASSETS_H_
+#define ASSETS_H_
+
+#include <boost/asio/io_context.hpp>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * In-memory copy of the static files in www.doc_root, so that serving them does not touch the SD card.
+ * Each file is kept in every encoding the client may ask for: as is, gzipped, and as found precompressed
+ * next to it on disk (file.br, file.gz).
+ */
+namespace assets {
+
+struct variant {
+    std::string encoding; // value for Content-Encoding, empty if not encoded
+    std::string etag; // strong entity tag, including the quotes
+    std::shared_ptr<const std::string> body;
+};
+
+struct asset {
+    std::string mime_type;
+    std::string cache_control;
+    std::vector<variant> variants; // the unencoded one first
+
+    // the smallest variant the client accepts according to its Accept-Encoding header
+    const variant& select(std::string_view accept_encoding) const;
+};
+
+/** Returns the file at the given path relative to the document root, or nullptr if there is no such file. */
+std::shared_ptr<const asset> find(std::string_view path);
+
+/** Keeps the cache up to date with the files on disk, by means of inotify on the given io_context. */
+void watch(boost::asio::io_context& ioc);
+
+} // namespace assets
+
+#endif /* ASSETS_H_ */
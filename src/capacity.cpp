@@ -0,0 +1,146 @@
+#include "core.h"
+#include "config.h"
+#include "settings.h"
+#include "logf.h"
+#include "mutex_protected.h"
+#include "www.h"
+
+#include <chrono>
+#include <time.h>
+
+using namespace std::literals::chrono_literals;
+
+namespace
+{
+
+using clock_type = std::chrono::system_clock;
+using quarter_hours = std::chrono::duration<int64_t, std::ratio<900>>;
+constexpr auto quarter_duration = quarter_hours{1};
+
+config::param<int> interval{"interval", 1000, config::reloadable};
+settings::param<double> month_peak{"capacity.month_peak", 0.0}; // W, highest quarter-hour average import this month
+settings::param<int> peak_month{"capacity.month", 0}; // yyyymm the month peak belongs to
+
+int month_of(clock_type::time_point tp)
+{
+    struct tm tm;
+    auto tt = clock_type::to_time_t(tp);
+    localtime_r(&tt, &tm);
+    return (tm.tm_year + 1900) * 100 + tm.tm_mon + 1;
+}
+
+// Keeps track of the energy imported from the grid during the current quarter-hour, aligned with the quarter-hours
+// of the meter, and of the highest quarter-hour average of the month, which the capacity tariff is based on.
+struct tracker : core::consumer
+{
+    struct state
+    {
+        clock_type::time_point quarter_start;
+        clock_type::time_point last_sample;
+        double energy = 0.0; // Ws imported since quarter_start
+
+        double average() const { return energy / (quarter_duration / 1s); } // W over the full quarter
+    };
+    mutex_protected<state> m_state;
+
+    tracker() : core::consumer("capacity") {}
+
+    void handle(const core::budget&, const core::situation& sit) override
+    {
+        auto tnow = clock_type::now();
+        auto import = std::max(0.0, sit.grid_output());
+        auto s = m_state.lock();
+        if (s->quarter_start == clock_type::time_point{}) {
+            s->quarter_start = std::chrono::floor<quarter_hours>(tnow);
+            s->last_sample = tnow;
+            return;
+        }
+        // the sample is assumed to be representative for the time elapsed since the previous one (up to a few ticks)
+        auto t0 = std::max(s->last_sample, tnow - 2 * std::chrono::milliseconds{interval});
+        s->last_sample = tnow;
+        while (tnow >= s->quarter_start + quarter_duration) {
+            auto quarter_end = s->quarter_start + quarter_duration;
+            if (t0 < quarter_end)
+                s->energy += import * std::chrono::duration<double>(quarter_end - t0).count();
+            t0 = std::max(t0, quarter_end);
+            complete_quarter(*s);
+            s->quarter_start = quarter_end;
+            s->energy = 0.0;
+        }
+        s->energy += import * std::chrono::duration<double>(tnow - t0).count();
+    }
+
+    void complete_quarter(const state& s)
+    {
+        auto month = month_of(s.quarter_start);
+        auto average = s.average();
+        logfdebug("Quarter-hour starting at %d s ended with an average import of %d W",
+                s.quarter_start.time_since_epoch() / 1s, int(average));
+        if (month != peak_month.get())
+            settings::apply({{"capacity.month_peak", average}, {"capacity.month", month}});
+        else if (average > month_peak.get())
+            settings::apply({{"capacity.month_peak", average}});
+    }
+
+    www::rpc m_rpc = www::rpc::get("capacity", [this] {
+        auto s = m_state.lock();
+        return nlohmann::json{
+            {"quarter_start", s->quarter_start.time_since_epoch() / 1s},
+            {"energy", s->energy / 3600.0},
+            {"average", s->average()},
+            {"month_peak", month_peak.get()},
+            {"month", peak_month.get()}
+        };
+    });
+} capacity_tracker;
+
+struct capacity_impl : core::policy
+{
+    capacity_impl() : core::policy{"capacity"} {}
+
+    virtual std::string_view icon() const { return "wi-time-4"; }
+    virtual std::string_view label() const { return "Bewaak capaciteitstarief"; }
+    virtual std::string_view description() const {
+        static std::string desc = str(boost::format(
+            "<p>Laad de wagen zo snel als mogelijk zonder de hoogste kwartierwaarde van deze maand "
+            "(minstens %s W) te overschrijden.</p>"
+            "<p>Het verbruik wordt niet per moment begrensd, maar per kwartier: zolang er in het lopende "
+            "kwartier nog ruimte is, mag het laadpunt tijdelijk meer afnemen, zodat het capaciteitstarief "
+            "niet stijgt maar er toch zo veel mogelijk geladen wordt.</p>"
+            ) % settings::html(m_min_peak));
+        return desc;
+    }
+
+    // Spread the energy that can still be imported during this quarter-hour without raising the peak
+    // over the time that remains, and hand out whatever the current import leaves of that.
+    core::budget apply(const core::situation& sit)
+    {
+        auto tnow = clock_type::now();
+        double energy_left, time_left;
+        {
+            // the tracker only rolls over to the next quarter-hour after the policies ran, so at the start of a new one
+            // its energy still belongs to the previous quarter-hour
+            auto s = capacity_tracker.m_state.lock();
+            auto quarter_start = std::chrono::floor<quarter_hours>(tnow);
+            auto energy = s->quarter_start == quarter_start ? s->energy : 0.0;
+            auto peak = std::max(peak_month.get() == month_of(tnow) ? month_peak.get() : 0.0, m_min_peak.get());
+            energy_left = peak * (quarter_duration / 1s) - energy;
+            time_left = std::chrono::duration<double>(quarter_start + quarter_duration - tnow).count();
+        }
+        time_left = std::max(time_left, 0.001 * interval.get());
+        auto power_budget = energy_left / time_left - std::max(0.0, sit.grid_output());
+        auto current_budget = power_budget / sit.grid_voltage() / sit.grid.size();
+
+        // never exceed what the main fuse can take, as in the red policy
+        auto maxphase = std::max_element(sit.grid.begin(), sit.grid.end(),
+                [](const auto& l, const auto& r) { return l.current < r.current; });
+        auto current_budget_fuse = m_max_current.get() - maxphase->current;
+
+        return core::budget{std::min(current_budget, current_budget_fuse), std::nullopt, current_budget_fuse};
+    }
+
+    settings::param<double> m_min_peak{"capacity.min_peak", 2500.0};
+    settings::param<double> m_max_current{"max_current", 0.0};
+} capacity;
+
+} // anonymous namespace
@@ -4,12 +4,19 @@
 
 #include <boost/algorithm/string/trim.hpp>
 
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <filesystem>
 #include <map>
+#include <set>
 #include <vector>
 #include <fstream>
 #include <optional>
 
 #include <signal.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 
 using namespace config;
 
@@ -31,10 +38,20 @@ struct param_desc {
 
 static int lock_recurse = 0;
 #define rlogferror(fmt...) if (lock_recurse <= 1) __logf(logseverity::error, fmt)
+#define rlogfinfo(fmt...)  if (lock_recurse <= 1) __logf(logseverity::info, fmt)
 #define rlogfdebug(fmt...) if (lock_recurse <= 1) __logf(logseverity::debug, fmt)
 
 struct registry {
     std::map<std::string, param_desc> m_params;
+    std::map<std::string, std::string> m_file_values; // as last read from the config files
+    std::set<std::string> m_overridden; // params set on the command line, which the config files do not change
+
+    void set_value(const std::string& name, std::string_view value) {
+        param_desc& desc = m_params[name];
+        desc.value = std::string{value};
+        for (auto* p : desc.subscribers)
+            param_parse(name, p, *desc.value);
+    }
 
     void param_parse(const std::string& name, param_base* p, std::string_view value) {
         try {
@@ -58,12 +75,16 @@ static auto get_registry() {
     return lock_type{instance};
 }
 
-struct config_file {
-    config_file(const char* path) {
+// the latter overrides the former
+constexpr std::array config_files = {"/etc/p1faker.conf", "p1faker.conf"};
+
+std::map<std::string, std::string> read_config_files() {
+    std::map<std::string, std::string> values;
+    for (auto path : config_files) {
         std::ifstream fin{std::string{path}};
         if (not fin.is_open()) {
             rlogfdebug("Could not open config file %s", path);
-            return;
+            continue;
         }
         rlogfdebug("Processing %s", path);
         while (fin.good() and not fin.eof()) {
@@ -80,12 +101,70 @@ struct config_file {
             std::string value = line.substr(pos + 1);
             boost::trim(name);
             boost::trim(value);
-            set_param(name, value);
+            values[name] = value;
+        }
+    }
+    return values;
+}
+
+struct config_files_type {
+    config_files_type() {
+        auto values = read_config_files();
+        auto reg = get_registry();
+        for (auto& [name, value] : values)
+            reg->set_value(name, value);
+        reg->m_file_values = std::move(values);
+    }
+} config_files_init;
+
+// Tells whether a config file changed, by means of inotify on the directories that hold them: editors tend to replace
+// a file by another one rather than write it.
+class watcher {
+public:
+    watcher() {
+        m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_fd < 0) {
+            rlogferror("Failed to watch config files: %s", strerror(errno));
+            return;
+        }
+        for (std::filesystem::path path : config_files) {
+            auto dir = path.parent_path().empty() ? std::filesystem::path{"."} : path.parent_path();
+            int wd = inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+            if (wd < 0) {
+                rlogferror("Failed to watch %s for changes: %s", path.string(), strerror(errno));
+                continue;
+            }
+            m_files.emplace(wd, path.filename());
+        }
+    }
+
+    ~watcher() {
+        if (m_fd >= 0)
+            ::close(m_fd);
+    }
+
+    // whether a config file changed since the last call; does not block
+    bool changed() {
+        bool result = false;
+        ssize_t n;
+        while (m_fd >= 0 and (n = ::read(m_fd, m_buffer.data(), m_buffer.size())) > 0) {
+            for (ssize_t pos = 0; pos + ssize_t(sizeof(inotify_event)) <= n; ) {
+                auto* event = reinterpret_cast<const inotify_event*>(m_buffer.data() + pos);
+                pos += sizeof(inotify_event) + event->len;
+                auto [begin, end] = m_files.equal_range(event->wd);
+                for (auto it = begin; it != end; ++it)
+                    if (event->len > 0 and it->second == event->name)
+                        result = true;
+            }
         }
+        return result;
     }
+
+private:
+    int m_fd = -1;
+    std::multimap<int, std::string> m_files; // names of the config files by watch descriptor of their directory
+    alignas(inotify_event) std::array<char, 4096> m_buffer;
 };
-config_file etc_config{"/etc/p1faker.conf"};
-config_file cwd_config{"p1faker.conf"};
 
 } // anonymous namespace
 
@@ -93,10 +172,38 @@ void config::set_param(std::string_view _name, std::string_view value)
 {
     auto reg = get_registry();
     auto name = std::string{_name};
-    param_desc& desc = reg->m_params[name];
-    desc.value = std::string{value};
-    for (auto* p : desc.subscribers)
-        reg->param_parse(name, p, *desc.value);
+    reg->m_overridden.insert(name);
+    reg->set_value(name, value);
+}
+
+void config::reload()
+{
+    static watcher w;
+    if (not w.changed())
+        return;
+    auto values = read_config_files();
+    auto reg = get_registry();
+    for (auto& [name, value] : values) {
+        auto it = reg->m_file_values.find(name);
+        if (it != reg->m_file_values.end() and it->second == value)
+            continue;
+        if (reg->m_overridden.contains(name)) {
+            rlogfinfo("Ignoring config param %s=%s from the config file: it is set on the command line", name, value);
+            continue;
+        }
+        auto& subscribers = reg->m_params[name].subscribers;
+        if (not std::all_of(subscribers.begin(), subscribers.end(), [](param_base* p) { return p->is_reloadable(); })) {
+            rlogferror("Ignoring config param %s=%s from the config file until restart: it is only read at startup",
+                    name, value);
+            continue;
+        }
+        rlogfinfo("Reloading config param %s=%s", name, value);
+        reg->set_value(name, value);
+    }
+    for (auto& [name, value] : reg->m_file_values)
+        if (not values.contains(name))
+            rlogfinfo("Config param %s was removed from the config file: keeping %s until restart", name, value);
+    reg->m_file_values = std::move(values);
 }
 
 void param_base::init()
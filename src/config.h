@@ -8,17 +8,33 @@ namespace config {
 
 void set_param(std::string_view name, std::string_view value);
 
+/**
+ * Applies the params that changed in the config files since the last call. Called by the control loop in between
+ * ticks, so that a tick sees either the old or the new values. Only reloadable params change: the others keep their
+ * value until restart, because other threads read them without synchronisation.
+ */
+void reload();
+
+/**
+ * Marks a param that reload() may change: one that only the control loop reads, or whose subclass hands the value
+ * over to other threads itself.
+ */
+struct reloadable_t {};
+inline constexpr reloadable_t reloadable;
+
 class param_base {
 public:
     virtual std::string parse(std::string_view text) = 0;
+    bool is_reloadable() const { return m_reloadable; }
 protected:
-    param_base(std::string_view name) : m_name(name) {}
+    param_base(std::string_view name, bool reloadable = false) : m_name(name), m_reloadable(reloadable) {}
     param_base(const param_base&) = delete;
     param_base& operator=(const param_base&) = delete;
     void init();
     virtual ~param_base();
 private:
     const std::string m_name;
+    const bool m_reloadable;
 };
 
 template<typename T, typename = void>
@@ -35,6 +51,7 @@ template<typename T, typename Parser = parser<T>>
 class param : param_base, Parser {
 public:
     param(std::string_view name, T default_value) : param_base(name), m_value(default_value) { init(); }
+    param(std::string_view name, T default_value, reloadable_t) : param_base(name, true), m_value(default_value) { init(); }
 
     operator const T&() const { return m_value; }
     const T& operator*() const { return m_value; }
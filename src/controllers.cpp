@@ -0,0 +1,265 @@
+#include "core.h"
+#include "config.h"
+#include "settings.h"
+#include "logf.h"
+#include "mutex_protected.h"
+#include "www.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+
+namespace
+{
+
+config::param<int> interval{"interval", 1000, config::reloadable};
+settings::param<double> car_min_power{"car_min_power", 5500.0};
+settings::param<double> car_max_power{"car_max_power", 11000.0};
+settings::param<double> car_ramp_rate{"car_ramp_rate", 0.0}; // W/s, 0 if the charge point follows without delay
+
+// The draw of the charge point is not measured, so keep track of what it is expected to draw after receiving the
+// budgets handed out, in current per phase. There is a single charge point, so the controllers and the filters share
+// this one estimate, and it is advanced once per tick with the budget the charge point finally sees, by
+// draw_tracker below. It is pulled back whenever it exceeds the measured consumption, e.g. because the car stopped
+// charging on its own, and starts at 0.
+double expected_draw = 0.0;
+
+// How the charge point responds to the current budget it sees: it aims at its present draw plus the budget,
+// refuses to charge below its minimum and ramps towards that target at a limited rate.
+// All values are expressed in current per phase.
+struct chargepoint
+{
+    double min;
+    double max;
+    double ramp; // per tick
+    double consumption; // upper bound for what the charge point can be drawing
+    double draw; // expected, see expected_draw
+
+    chargepoint(const core::situation& sit)
+    {
+        auto watt_per_ampere = sit.grid_voltage() * sit.grid.size();
+        consumption = std::max(0.0, sit.consumption() / watt_per_ampere);
+        draw = expected_draw = std::min(expected_draw, consumption);
+        min = car_min_power.get() / watt_per_ampere;
+        max = car_max_power.get() / watt_per_ampere;
+        ramp = car_ramp_rate.get() > 0.0 ? car_ramp_rate.get() * 0.001 * interval.get() / watt_per_ampere
+                                         : std::numeric_limits<double>::infinity();
+    }
+
+    double target(double draw, double budget) const
+    {
+        auto t = draw + budget;
+        return t < min ? 0.0 : std::min(t, max);
+    }
+
+    double step(double draw, double target) const
+    {
+        return target == 0.0 ? 0.0 : draw + std::clamp(target - draw, -ramp, ramp);
+    }
+
+    // A deficit larger than the expected draw cannot be made up by the charge point as far as the estimate knows,
+    // so the charge point must be drawing more than expected, e.g. because it was already charging when p1faker
+    // started. Such a budget is passed on as is, instead of being clamped to what the estimate explains, which would
+    // never ask the charge point to reduce.
+    double unexplained(const core::budget& b, double current) const
+    {
+        return b.current < -draw ? std::min(current, b.current) : current;
+    }
+};
+
+struct pi_impl : core::controller
+{
+    pi_impl() : core::controller{"pi"} {}
+
+    void reset() override
+    {
+        m_integral = expected_draw;
+        m_saturated = false;
+    }
+
+    // The integral part tracks the draw the budget asks for, the proportional part anticipates on the remaining error.
+    // Integration is suspended while the charge point is still ramping towards its target or the output is capped,
+    // so that it does not wind up during the ramp and overshoot afterwards.
+    core::budget control(const core::budget& b, const core::situation& sit) override
+    {
+        chargepoint cp{sit};
+        if (not m_saturated)
+            m_integral = std::clamp(m_integral + m_ki.get() * b.current, 0.0, cp.max);
+        auto setpoint = std::clamp(m_integral + m_kp.get() * b.current, 0.0, cp.max);
+
+        core::budget result = b;
+        auto wanted = cp.unexplained(b, setpoint - cp.draw);
+        result.current = std::min(wanted, b.limit);
+
+        auto target = cp.target(cp.draw, result.current);
+        m_saturated = result.current < wanted or target != cp.step(cp.draw, target);
+        return result;
+    }
+
+    settings::param<double> m_kp{"controller.pi.kp", 0.3};
+    settings::param<double> m_ki{"controller.pi.ki", 0.3};
+    double m_integral = 0.0;
+    bool m_saturated = false;
+};
+
+struct mpc_impl : core::controller
+{
+    mpc_impl() : core::controller{"mpc"} {}
+
+    void reset() override
+    {
+        m_history.clear();
+    }
+
+    // The measurements lag behind by a few ticks, so the budget reflects what the charge point drew back then.
+    // Correct for that to estimate the current available for the car now, then pick the target that keeps the
+    // predicted draw closest to it over the horizon, taking the minimum power, the ramp and the cost of
+    // starting or stopping a charge session into account.
+    core::budget control(const core::budget& b, const core::situation& sit) override
+    {
+        chargepoint cp{sit};
+        auto size = std::size_t(std::max(1, m_delay.get() + 1));
+        m_history.push_back(cp.draw);
+        while (m_history.size() > size)
+            m_history.pop_front();
+        if (m_history.size() < size)
+            m_history.insert(m_history.begin(), size - m_history.size(), cp.draw);
+        if (auto excess = m_history.front() - cp.consumption; excess > 0.0) {
+            for (auto& draw : m_history)
+                draw = std::max(0.0, draw - excess);
+            cp.draw = expected_draw = m_history.back();
+        }
+        auto available = b.current + m_history.front();
+
+        double best_target = cp.draw;
+        double best_cost = std::numeric_limits<double>::infinity();
+        for (double target : {0.0, cp.min, cp.max, cp.target(0.0, available), cp.draw}) {
+            if (target > 0.0 and target < cp.min)
+                continue;
+            double cost = 0.0;
+            double draw = cp.draw;
+            for (int i = 0; i < m_horizon.get(); i++) {
+                draw = cp.step(draw, target);
+                cost += (available - draw) * (available - draw);
+            }
+            if ((target > 0.0) != (cp.draw > 0.0))
+                cost += m_switch_penalty.get() * cp.min * cp.min;
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_target = target;
+            }
+        }
+
+        core::budget result = b;
+        result.current = std::min(cp.unexplained(b, best_target - cp.draw), b.limit);
+        return result;
+    }
+
+    settings::param<int> m_horizon{"controller.mpc.horizon", 10}; // ticks
+    settings::param<int> m_delay{"controller.mpc.delay", 0}; // ticks before the measurements reflect a changed draw
+    settings::param<double> m_switch_penalty{"controller.mpc.switch_penalty", 1.0};
+    std::deque<double> m_history; // expected draws, the last one for now
+};
+
+// Keeps the charge point from stopping and restarting all the time when the budget hovers around its minimum power.
+// A charge session only starts once the power available for the car exceeds the start threshold and only stops once
+// it drops below the stop threshold, and either state is held for a minimum time. While on, the charge point is
+// granted at least its minimum power, within the limit of the main fuse.
+struct hysteresis_impl : core::filter
+{
+    using clock_type = std::chrono::steady_clock;
+
+    hysteresis_impl() : core::filter{"hysteresis"} {}
+
+    struct state
+    {
+        bool on = false;
+        clock_type::time_point since = clock_type::now();
+        unsigned starts = 0;
+        unsigned stops = 0;
+        unsigned held_on = 0; // ticks the charge point kept charging only because of the minimum on time
+        unsigned held_off = 0; // ticks the charge point was kept off only because of the minimum off time
+        double draw = 0.0; // W
+    };
+    mutex_protected<state> m_state;
+
+    core::budget apply(const core::budget& b, const core::situation& sit) override
+    {
+        chargepoint cp{sit};
+        auto watt_per_ampere = sit.grid_voltage() * sit.grid.size();
+        auto available = (cp.draw + b.current) * watt_per_ampere;
+        auto tnow = clock_type::now();
+
+        auto s = m_state.lock();
+        auto switch_to = [&](bool on) {
+            logfdebug("Hysteresis: %s charging with %d W available", on ? "start" : "stop", int(available));
+            s->on = on;
+            s->since = tnow;
+            (on ? s->starts : s->stops)++;
+        };
+
+        core::budget result = b;
+        if (not m_enable.get()) {
+            if (s->on != (cp.draw > 0.0))
+                switch_to(cp.draw > 0.0);
+        } else {
+            if (s->on and available < m_stop_threshold.get()) {
+                if (tnow - s->since >= std::chrono::seconds{m_min_on_time.get()})
+                    switch_to(false);
+                else
+                    s->held_on++;
+            } else if (not s->on and available >= m_start_threshold.get()) {
+                if (tnow - s->since >= std::chrono::seconds{m_min_off_time.get()})
+                    switch_to(true);
+                else
+                    s->held_off++;
+            }
+            result.current = s->on ? std::min(cp.unexplained(b, std::max(b.current, cp.min - cp.draw)), b.limit)
+                                   : std::min(b.current, -cp.draw);
+        }
+
+        s->draw = cp.draw * watt_per_ampere;
+        return result;
+    }
+
+    www::rpc m_rpc = www::rpc::get("hysteresis", [this] {
+        auto s = m_state.lock();
+        return nlohmann::json{
+            {"enabled", m_enable.get()},
+            {"state", s->on ? "on" : "off"},
+            {"duration", std::chrono::duration_cast<std::chrono::seconds>(clock_type::now() - s->since).count()},
+            {"starts", s->starts},
+            {"stops", s->stops},
+            {"held_on", s->held_on},
+            {"held_off", s->held_off},
+            {"draw", s->draw}
+        };
+    });
+
+    settings::param<bool> m_enable{"hysteresis.enable", false};
+    settings::param<int> m_min_on_time{"hysteresis.min_on_time", 300}; // s
+    settings::param<int> m_min_off_time{"hysteresis.min_off_time", 300}; // s
+    settings::param<double> m_start_threshold{"hysteresis.start_threshold", 6000.0}; // W available for the car
+    settings::param<double> m_stop_threshold{"hysteresis.stop_threshold", 4000.0}; // W available for the car
+};
+
+// Advances expected_draw with the budget the charge point sees. Filters are applied in order of registration, so this
+// one has to be registered after the others.
+struct draw_tracker : core::filter
+{
+    draw_tracker() : core::filter{"draw_tracker"} {}
+
+    core::budget apply(const core::budget& b, const core::situation& sit) override
+    {
+        chargepoint cp{sit};
+        expected_draw = cp.step(cp.draw, cp.target(cp.draw, b.current));
+        return b;
+    }
+};
+
+pi_impl pi;
+mpc_impl mpc;
+hysteresis_impl hysteresis;
+draw_tracker tracker;
+
+} // anonymous namespace
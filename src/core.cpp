@@ -3,6 +3,7 @@
 #include "mutex_protected.h"
 #include "config.h"
 #include "logf.h"
+#include "metrics.h"
 #include "settings.h"
 #include "www.h"
 
@@ -10,10 +11,12 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <map>
 #include <vector>
 #include <chrono>
 #include <thread>
+#include <utility>
 
 using namespace std::literals::chrono_literals;
 
@@ -29,14 +32,24 @@ struct registry {
 
     std::map<int, producer*> producers;
     std::map<int, policy*> policies;
+    std::map<int, controller*> controllers;
+    std::map<int, filter*> filters;
     std::map<int, consumer*> consumers;
+    std::vector<std::function<void()>> startup;
     settings::param<int> active_policy{"active_policy", 0};
+    settings::param<std::string> active_controller{"active_controller", "none"};
 
 private:
     registry() {}
     friend class mutex_protected<registry>;
 };
 
+metrics::gauge active_policy_metric{"p1faker_active_policy", "Index of the active policy"};
+metrics::gauge tick_seconds{"p1faker_tick_seconds", "Duration of the last tick of the control loop"};
+metrics::counter tick_seconds_total{"p1faker_tick_seconds_total", "Time spent in ticks of the control loop"};
+metrics::counter ticks_total{"p1faker_ticks_total", "Ticks of the control loop"};
+metrics::counter late_ticks_total{"p1faker_late_ticks_total", "Ticks of the control loop that took longer than the interval"};
+
 template<typename T>
 int next_id(const std::map<int, T>& map) {
     return map.empty() ? 0 : map.rbegin()->first + 1;
@@ -56,6 +69,76 @@ auto policies_rpc = www::rpc::get("policies", [] {
     return policies;
 });
 
+// The budgets every policy would hand out, evaluated each tick against the same situation as the active one,
+// so that the effect of switching to another policy can be judged beforehand. Kept for the last hour.
+struct shadow_log {
+    static auto lock() {
+        static mutex_protected<shadow_log> instance;
+        return instance.lock();
+    }
+
+    std::vector<std::pair<int, std::string>> policies; // index and name of the policies, in the order of the budgets in a sample
+    std::vector<budget> samples; // ring buffer of policies.size() budgets per tick
+    std::size_t next = 0; // sample that gets overwritten next
+    std::size_t count = 0; // valid samples
+    double watt_per_ampere = 0.0;
+
+    std::size_t capacity() const { return policies.empty() ? 0 : samples.size() / policies.size(); }
+
+    void record(const std::map<int, policy*>& reg, const std::vector<budget>& budgets, std::size_t length, double wpa) {
+        if (capacity() != length or policies.size() != reg.size()
+                or not std::equal(policies.begin(), policies.end(), reg.begin(), [](auto&& l, auto&& r) { return l.first == r.first; })) {
+            policies.clear();
+            for (auto&& [index, ptr] : reg)
+                policies.emplace_back(index, ptr->name());
+            samples.assign(length * policies.size(), budget{});
+            next = count = 0;
+        }
+        std::copy(budgets.begin(), budgets.end(), samples.begin() + next * policies.size());
+        next = (next + 1) % capacity();
+        count = std::min(count + 1, capacity());
+        watt_per_ampere = wpa;
+    }
+
+private:
+    shadow_log() {}
+    friend class mutex_protected<shadow_log>;
+};
+
+auto shadow_rpc = www::rpc::get("shadow", [] {
+    // a copy, so that building the response does not hold up the tick, which records under the same lock
+    auto log = shadow_log{*shadow_log::lock()};
+    nlohmann::json policies = nlohmann::json::array();
+    for (std::size_t p = 0; p < log.policies.size(); p++) {
+        nlohmann::json history = nlohmann::json::array();
+        double sum = 0.0;
+        for (std::size_t i = 0; i < log.count; i++) {
+            auto& b = log.samples[(log.next + log.capacity() - log.count + i) % log.capacity() * log.policies.size() + p];
+            history.push_back(b.current);
+            sum += b.current;
+        }
+        auto& last = log.samples[(log.next + log.capacity() - 1) % log.capacity() * log.policies.size() + p];
+        policies.push_back({
+            {"index", log.policies[p].first},
+            {"name", log.policies[p].second},
+            {"current", last.current},
+            {"power", last.current * log.watt_per_ampere},
+            {"battery_output", last.battery_output ? nlohmann::json(*last.battery_output) : nlohmann::json()},
+            {"average_power", log.count ? sum / log.count * log.watt_per_ampere : 0.0},
+            {"history", history} // current budget per tick, oldest first
+        });
+    }
+    return policies;
+});
+
+auto controllers_rpc = www::rpc::get("controllers", [] {
+    auto reg = registry::lock();
+    nlohmann::json controllers = nlohmann::json::array();
+    for (auto&& [index, ptr] : reg->controllers)
+        controllers.push_back(ptr->name());
+    return controllers;
+});
+
 } // anonymous namespace
 
 producer::producer(std::string_view _name)
@@ -83,7 +166,35 @@ policy::policy(std::string_view _name)
 policy::~policy() {
     auto reg = registry::lock();
     logfdebug("Unregister policy %s (index %d)", name(), m_index);
-    reg->producers.erase(m_index);
+    reg->policies.erase(m_index);
+}
+
+controller::controller(std::string_view _name)
+: m_name(_name) {
+    auto reg = registry::lock();
+    m_index = next_id(reg->controllers);
+    logfdebug("Register controller %s (index %d)", name(), m_index);
+    reg->controllers.emplace(m_index, this);
+}
+
+controller::~controller() {
+    auto reg = registry::lock();
+    logfdebug("Unregister controller %s (index %d)", name(), m_index);
+    reg->controllers.erase(m_index);
+}
+
+filter::filter(std::string_view _name)
+: m_name(_name) {
+    auto reg = registry::lock();
+    m_index = next_id(reg->filters);
+    logfdebug("Register filter %s (index %d)", name(), m_index);
+    reg->filters.emplace(m_index, this);
+}
+
+filter::~filter() {
+    auto reg = registry::lock();
+    logfdebug("Unregister filter %s (index %d)", name(), m_index);
+    reg->filters.erase(m_index);
 }
 
 consumer::consumer(std::string_view _name)
@@ -100,6 +211,11 @@ consumer::~consumer() {
     reg->consumers.erase(m_index);
 }
 
+int core::at_startup(std::function<void()> f) {
+    registry::lock()->startup.push_back(std::move(f));
+    return 0;
+}
+
 int main(int argc, const char **argv) {
     while (++argv, --argc) {
         if (std::strncmp(*argv, "--", 2) or argc < 2) {
@@ -111,13 +227,19 @@ int main(int argc, const char **argv) {
         config::set_param(name, *argv);
     }
 
+    // without the lock, because modules register producers and consumers when they start
+    for (auto& start : std::exchange(registry::lock()->startup, {}))
+        start();
+
     auto t0 = std::chrono::system_clock::now();
-    auto interval_config = config::param{"interval", 1000};
+    auto interval_config = config::param{"interval", 1000, config::reloadable};
     auto interval = std::chrono::milliseconds{interval_config};
     int active_policy = -1;
+    std::string active_controller;
 
     situation sit;
     budget b;
+    std::vector<budget> shadow_budgets;
 
     auto phase_config = config::param{"phases", 3};
     sit.grid.resize(phase_config);
@@ -127,6 +249,9 @@ int main(int argc, const char **argv) {
     sigaddset(&sigset, SIGINT);
 
     do {
+        auto tick_start = std::chrono::steady_clock::now();
+        config::reload();
+        interval = std::chrono::milliseconds{interval_config};
         auto reg = registry::lock();
         for (auto&& [name, producer] : reg->producers)
             producer->poll(sit);
@@ -134,15 +259,45 @@ int main(int argc, const char **argv) {
         if (reg->active_policy.get() != active_policy) {
             logfinfo("Activating policy %s", policy_it == reg->policies.end() ? std::string_view{"null"} : policy_it->second->name());
             active_policy = reg->active_policy.get();
+            active_policy_metric.set(active_policy);
         }
         if (policy_it != reg->policies.end())
             b = policy_it->second->apply(sit);
 
+        auto controller_name = reg->active_controller.get();
+        auto controller_it = std::find_if(reg->controllers.begin(), reg->controllers.end(),
+                [&](auto&& entry) { return entry.second->name() == controller_name; });
+        if (controller_name != active_controller) {
+            logfinfo("Activating controller %s", controller_it == reg->controllers.end() ? std::string_view{"null"} : controller_it->second->name());
+            if (controller_it != reg->controllers.end())
+                controller_it->second->reset();
+            active_controller = controller_name;
+        }
+        auto out = controller_it == reg->controllers.end() ? b : controller_it->second->control(b, sit);
+        for (auto&& [name, filter] : reg->filters)
+            out = filter->apply(out, sit);
+
         for (auto&& [name, consumer] : reg->consumers)
-            consumer->handle(b, sit);
+            consumer->handle(out, sit);
+
+        // Only now that the consumers are served, evaluate the other policies as well. A policy takes a few
+        // microseconds, far less than handing the work to other threads would, so they simply run in turn.
+        shadow_budgets.clear();
+        for (auto&& [index, policy] : reg->policies)
+            shadow_budgets.push_back(policy_it != reg->policies.end() and index == policy_it->first ? b : policy->apply(sit));
+        shadow_log::lock()->record(reg->policies, shadow_budgets, std::max<std::size_t>(1, 1h / interval),
+                sit.grid_voltage() * sit.grid.size());
+
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - tick_start;
+        tick_seconds.set(duration.count());
+        tick_seconds_total.inc(duration.count());
+        ticks_total.inc();
     } while ([&] {
         auto t1 = std::chrono::system_clock::now();
-        if (t1 > t0 + interval) logfwarn("Finished current interval late: it took %s", duration_cast<std::chrono::milliseconds>(t1 - t0));
+        if (t1 > t0 + interval) {
+            late_ticks_total.inc();
+            logfwarn("Finished current interval late: it took %s", duration_cast<std::chrono::milliseconds>(t1 - t0));
+        }
         t0 = std::max(t1, t0 + interval);
         timespec ts = { decltype(ts.tv_sec)((t0 - t1) / 1s), decltype(ts.tv_nsec)((t0 - t1) % 1s / 1ns) };
         return sigtimedwait(&sigset, nullptr, &ts) < 0;
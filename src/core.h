@@ -1,10 +1,13 @@
 #ifndef CORE_H_
 #define CORE_H_
 
+#include <functional>
 #include <vector>
 #include <string_view>
 #include <string>
 #include <numeric>
+#include <limits>
+#include <optional>
 
 namespace core {
 
@@ -34,6 +37,8 @@ struct situation {
 
 struct budget {
     double current = 0.0;
+    std::optional<double> battery_output; // battery discharge setpoint (negative to charge), unset to let battery follow its own control loop
+    double limit = std::numeric_limits<double>::infinity(); // hard upper bound for current, which controllers may never exceed
 };
 
 struct producer {
@@ -55,6 +60,10 @@ struct policy {
     virtual std::string_view label() const { return "Custom policy"; }
     virtual std::string_view description() const { return "This is an undocumented custom policy."; }
 
+    /**
+     * Every policy is evaluated each tick, also when it is not active, to show what it would do. So apply must not
+     * have side effects: state that has to evolve with the measurements belongs in a producer or consumer.
+     */
     virtual budget apply(const situation&) = 0;
 
 protected:
@@ -66,6 +75,41 @@ private:
     int m_index;
 };
 
+/**
+ * Sits between the active policy and the consumers: turns the budget a policy asks for into the budget that is
+ * actually handed out, e.g. to damp the response of the charge point. Only the active controller is invoked.
+ */
+struct controller {
+    std::string_view name() const { return m_name; }
+
+    virtual budget control(const budget&, const situation&) = 0;
+    virtual void reset() {} // called on activation, to forget state built up during an earlier activation
+
+protected:
+    controller(std::string_view name);
+    virtual ~controller();
+private:
+    const std::string m_name;
+    int m_index;
+};
+
+/**
+ * Adjusts the budget the active controller hands out before the consumers get it, e.g. to limit how often the charge
+ * point starts and stops. Unlike controllers, all filters are applied, in order of registration.
+ */
+struct filter {
+    std::string_view name() const { return m_name; }
+
+    virtual budget apply(const budget&, const situation&) = 0;
+
+protected:
+    filter(std::string_view name);
+    virtual ~filter();
+private:
+    const std::string m_name;
+    int m_index;
+};
+
 struct consumer {
     std::string_view name() const { return m_name; }
 
@@ -79,6 +123,13 @@ private:
     int m_index;
 };
 
+/**
+ * Calls f in main, once the command line has been applied to the config params and before the first tick. For
+ * optional modules, which would read their enable param too early during static initialization. Returns 0, to
+ * initialize a variable at namespace scope with.
+ */
+int at_startup(std::function<void()> f);
+
 } // namespace core
 
 #endif /* CORE_H_ */
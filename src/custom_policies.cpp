@@ -0,0 +1,85 @@
+#include "core.h"
+#include "expression.h"
+#include "logf.h"
+#include "settings.h"
+
+#include <algorithm>
+#include <cmath>
+#include <list>
+
+namespace
+{
+
+// Policies defined in the settings instead of in C++, e.g.
+//   "custom_policies": [{"name": "sunny", "label": "Enkel zon", "icon": "wi-day-sunny",
+//                        "expression": "min(solar_output + battery_max_power, inverter_max_power) - consumption"}]
+// The expression yields the power budget in W. As for the built-in policies, the budget never exceeds what the main
+// fuse can take. They are registered at startup, after the built-in policies, so changes take effect on restart.
+settings::param<nlohmann::json> definitions{"custom_policies", nlohmann::json::array()};
+
+std::string escape_html(std::string_view text)
+{
+    std::string result;
+    for (char c : text) {
+        switch (c) {
+        case '<': result += "&lt;"; break;
+        case '>': result += "&gt;"; break;
+        case '&': result += "&amp;"; break;
+        default: result += c;
+        }
+    }
+    return result;
+}
+
+struct custom_policy : core::policy
+{
+    custom_policy(std::string_view name, expression::program&& program, const nlohmann::json& def)
+    : core::policy{name}
+    , m_program{std::move(program)}
+    , m_icon{def.value("icon", std::string{core::policy::icon()})}
+    , m_label{def.value("label", std::string{name})}
+    , m_description{def.value("description", "<p>" + escape_html(def.at("expression").get<std::string>()) + "</p>")}
+    {}
+
+    virtual std::string_view icon() const { return m_icon; }
+    virtual std::string_view label() const { return m_label; }
+    virtual std::string_view description() const { return m_description; }
+
+    core::budget apply(const core::situation& sit)
+    {
+        auto power_budget = m_program.evaluate(sit);
+        if (not std::isfinite(power_budget))
+            power_budget = 0.0;
+        auto current_budget = power_budget / sit.grid_voltage() / sit.grid.size();
+
+        auto maxphase = std::max_element(sit.grid.begin(), sit.grid.end(),
+                [](const auto& l, const auto& r) { return l.current < r.current; });
+        auto current_budget_fuse = m_max_current.get() - maxphase->current;
+
+        return core::budget{std::min(current_budget, current_budget_fuse), std::nullopt, current_budget_fuse};
+    }
+
+    expression::program m_program;
+    const std::string m_icon;
+    const std::string m_label;
+    const std::string m_description;
+    settings::param<double> m_max_current{"max_current", 0.0};
+};
+
+// at startup, when all the settings that an expression may refer to are registered
+std::list<custom_policy> policies;
+int _ = core::at_startup([] {
+    for (const auto& def : definitions.get()) {
+        try {
+            auto name = def.at("name").get<std::string>();
+            // compile before registering, so that a policy with an invalid expression does not take an index
+            auto program = expression::program::compile(def.at("expression").get<std::string>());
+            policies.emplace_back(name, std::move(program), def);
+            logfinfo("Loaded custom policy %s", name);
+        } catch (std::exception& e) {
+            logferror("Failed to load custom policy %s: %s", def.dump(), e.what());
+        }
+    }
+});
+
+} // anonymous namespace
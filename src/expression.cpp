@@ -0,0 +1,239 @@
+#include "expression.h"
+
+#include <boost/format.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+
+using namespace expression;
+
+namespace {
+
+struct variable {
+    std::string_view name;
+    double (*get)(const core::situation&);
+};
+
+const std::array variables = {
+    variable{"battery_state", [](const core::situation& sit) { return sit.battery_state; }},
+    variable{"inverter_output", [](const core::situation& sit) { return sit.inverter_output; }},
+    variable{"battery_output", [](const core::situation& sit) { return sit.battery_output; }},
+    variable{"solar_output", [](const core::situation& sit) { return sit.solar_output(); }},
+    variable{"grid_output", [](const core::situation& sit) { return sit.grid_output(); }},
+    variable{"grid_voltage", [](const core::situation& sit) { return sit.grid_voltage(); }},
+    variable{"consumption", [](const core::situation& sit) { return sit.consumption(); }},
+    variable{"phases", [](const core::situation& sit) { return double(sit.grid.size()); }},
+    variable{"max_phase_current", [](const core::situation& sit) {
+        return std::max_element(sit.grid.begin(), sit.grid.end(),
+                [](const auto& l, const auto& r) { return l.current < r.current; })->current;
+    }},
+};
+
+} // anonymous namespace
+
+// Recursive descent parser that emits the code for each operand before the operator, so that the result is
+// directly executable by a stack machine.
+struct program::compiler {
+    std::string_view text;
+    std::size_t pos = 0;
+    program& prog;
+    int depth = 0; // stack depth at this point of the code
+    int max_depth = 0;
+
+    [[noreturn]] void fail(std::string_view what) const {
+        throw error{str(boost::format("%s at position %d of \"%s\"") % what % pos % text)};
+    }
+
+    void skip_space() {
+        while (pos < text.size() and std::isspace(static_cast<unsigned char>(text[pos])))
+            pos++;
+    }
+
+    bool accept(std::string_view token) {
+        skip_space();
+        if (text.substr(pos, token.size()) != token)
+            return false;
+        pos += token.size();
+        return true;
+    }
+
+    void expect(std::string_view token) {
+        if (not accept(token))
+            fail(str(boost::format("expected '%s'") % token));
+    }
+
+    void emit(opcode op, uint16_t arg, int pushed, int popped) {
+        prog.m_code.push_back(instruction{op, arg});
+        depth += pushed - popped;
+        max_depth = std::max(max_depth, depth);
+        if (std::size_t(max_depth) > max_stack)
+            fail("expression too deeply nested");
+    }
+    void emit_unary(opcode op) { emit(op, 0, 1, 1); }
+    void emit_binary(opcode op) { emit(op, 0, 1, 2); }
+
+    void logical_or() {
+        logical_and();
+        while (accept("||")) { logical_and(); emit_binary(opcode::logical_or); }
+    }
+
+    void logical_and() {
+        comparison();
+        while (accept("&&")) { comparison(); emit_binary(opcode::logical_and); }
+    }
+
+    void comparison() {
+        sum();
+        static constexpr std::pair<std::string_view, opcode> operators[] = {
+            {"<=", opcode::le}, {">=", opcode::ge}, {"==", opcode::eq}, {"!=", opcode::ne}, {"<", opcode::lt}, {">", opcode::gt}
+        };
+        for (auto [token, op] : operators) {
+            if (accept(token)) {
+                sum();
+                emit_binary(op);
+                return;
+            }
+        }
+    }
+
+    void sum() {
+        term();
+        while (true) {
+            if (accept("+")) { term(); emit_binary(opcode::add); }
+            else if (accept("-")) { term(); emit_binary(opcode::sub); }
+            else return;
+        }
+    }
+
+    void term() {
+        unary();
+        while (true) {
+            if (accept("*")) { unary(); emit_binary(opcode::mul); }
+            else if (accept("/")) { unary(); emit_binary(opcode::div); }
+            else return;
+        }
+    }
+
+    void unary() {
+        if (accept("-")) { unary(); emit_unary(opcode::neg); }
+        else if (accept("!")) { unary(); emit_unary(opcode::logical_not); }
+        else primary();
+    }
+
+    int arguments() {
+        expect("(");
+        int count = 0;
+        if (not accept(")")) {
+            do { logical_or(); count++; } while (accept(","));
+            expect(")");
+        }
+        return count;
+    }
+
+    void function(std::string_view name) {
+        auto start = pos;
+        int count = arguments();
+        auto check = [&](bool ok) { if (not ok) { pos = start; fail(str(boost::format("wrong number of arguments for %s") % name)); } };
+        if (name == "min" or name == "max") {
+            check(count >= 1);
+            for (int i = 1; i < count; i++)
+                emit_binary(name == "min" ? opcode::min : opcode::max);
+        } else if (name == "abs") {
+            check(count == 1);
+            emit_unary(opcode::abs);
+        } else if (name == "clamp") {
+            check(count == 3);
+            emit(opcode::clamp, 0, 1, 3);
+        } else if (name == "if") {
+            check(count == 3);
+            emit(opcode::select, 0, 1, 3);
+        } else {
+            pos = start;
+            fail(str(boost::format("unknown function %s") % name));
+        }
+    }
+
+    void primary() {
+        skip_space();
+        if (accept("(")) {
+            logical_or();
+            expect(")");
+            return;
+        }
+        if (pos < text.size() and (std::isdigit(static_cast<unsigned char>(text[pos])) or text[pos] == '.')) {
+            double value;
+            auto [end, ec] = std::from_chars(text.data() + pos, text.data() + text.size(), value);
+            if (ec != std::errc{})
+                fail("invalid number");
+            pos = end - text.data();
+            prog.m_constants.push_back(value);
+            emit(opcode::constant, prog.m_constants.size() - 1, 1, 0);
+            return;
+        }
+        auto start = pos;
+        while (pos < text.size() and (std::isalnum(static_cast<unsigned char>(text[pos])) or text[pos] == '_' or text[pos] == '.'))
+            pos++;
+        auto name = text.substr(start, pos - start);
+        if (name.empty())
+            fail("expected a number, a name or '('");
+        skip_space();
+        if (pos < text.size() and text[pos] == '(')
+            return function(name);
+        auto var = std::find_if(variables.begin(), variables.end(), [&](auto& v) { return v.name == name; });
+        if (var != variables.end())
+            return emit(opcode::variable, var - variables.begin(), 1, 0);
+        // only settings that exist already: a typo must not become a new setting that silently evaluates to 0
+        auto value = settings::get(name);
+        if (not value or not value->is_number()) {
+            pos = start;
+            fail(str(boost::format(value ? "setting %s is not a number" : "unknown name %s") % name));
+        }
+        prog.m_settings.push_back(std::make_unique<settings::param<double>>(name, value->get<double>()));
+        emit(opcode::setting, prog.m_settings.size() - 1, 1, 0);
+    }
+};
+
+program program::compile(std::string_view text) {
+    program prog;
+    compiler c{text, 0, prog};
+    c.logical_or();
+    c.skip_space();
+    if (c.pos != text.size())
+        c.fail("unexpected input");
+    return prog;
+}
+
+double program::evaluate(const core::situation& sit) const {
+    std::array<double, max_stack> stack;
+    double* top = stack.data(); // one past the topmost value
+    for (auto [op, arg] : m_code) {
+        switch (op) {
+        case opcode::constant: *top++ = m_constants[arg]; break;
+        case opcode::variable: *top++ = variables[arg].get(sit); break;
+        case opcode::setting: *top++ = m_settings[arg]->get(); break;
+        case opcode::add: top--; top[-1] += top[0]; break;
+        case opcode::sub: top--; top[-1] -= top[0]; break;
+        case opcode::mul: top--; top[-1] *= top[0]; break;
+        case opcode::div: top--; top[-1] /= top[0]; break;
+        case opcode::neg: top[-1] = -top[-1]; break;
+        case opcode::lt: top--; top[-1] = top[-1] < top[0]; break;
+        case opcode::le: top--; top[-1] = top[-1] <= top[0]; break;
+        case opcode::gt: top--; top[-1] = top[-1] > top[0]; break;
+        case opcode::ge: top--; top[-1] = top[-1] >= top[0]; break;
+        case opcode::eq: top--; top[-1] = top[-1] == top[0]; break;
+        case opcode::ne: top--; top[-1] = top[-1] != top[0]; break;
+        case opcode::logical_and: top--; top[-1] = top[-1] != 0.0 and top[0] != 0.0; break;
+        case opcode::logical_or: top--; top[-1] = top[-1] != 0.0 or top[0] != 0.0; break;
+        case opcode::logical_not: top[-1] = top[-1] == 0.0; break;
+        case opcode::min: top--; top[-1] = std::min(top[-1], top[0]); break;
+        case opcode::max: top--; top[-1] = std::max(top[-1], top[0]); break;
+        case opcode::abs: top[-1] = std::abs(top[-1]); break;
+        case opcode::clamp: top -= 2; top[-1] = std::min(std::max(top[-1], top[0]), top[1]); break;
+        case opcode::select: top -= 2; top[-1] = top[-1] != 0.0 ? top[0] : top[1]; break;
+        }
+    }
+    return top[-1];
+}
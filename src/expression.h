@@ -0,0 +1,57 @@
+#ifndef EXPRESSION_H_
+#define EXPRESSION_H_
+
+#include "core.h"
+#include "settings.h"
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+namespace expression {
+
+struct error : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+/**
+ * Arithmetic expression over the fields of a core::situation and the settings, e.g.
+ * "min(solar_output + battery_max_power, inverter_max_power) - consumption".
+ *
+ * Supports numbers, + - * /, comparisons and && || ! (yielding 1 or 0), parentheses and the functions min, max, abs,
+ * clamp(x, lo, hi) and if(condition, then, else). Names that are not a field of the situation refer to a number setting
+ * that a module registered; any other name fails to compile.
+ *
+ * The text is compiled once to bytecode for a small stack machine, so evaluating it does not allocate.
+ */
+class program {
+public:
+    static program compile(std::string_view text); // throws expression::error
+
+    double evaluate(const core::situation&) const;
+
+private:
+    enum class opcode : uint8_t {
+        constant, variable, setting,
+        add, sub, mul, div, neg,
+        lt, le, gt, ge, eq, ne, logical_and, logical_or, logical_not,
+        min, max, abs, clamp, select
+    };
+    struct instruction {
+        opcode op;
+        uint16_t arg = 0; // index in constants, variables or settings
+    };
+    static constexpr std::size_t max_stack = 32;
+
+    struct compiler;
+
+    std::vector<instruction> m_code;
+    std::vector<double> m_constants;
+    std::vector<std::unique_ptr<settings::param<double>>> m_settings;
+};
+
+} // namespace expression
+
+#endif /* EXPRESSION_H_ */
@@ -0,0 +1,193 @@
+#include "core.h"
+#include "logf.h"
+#include "mutex_protected.h"
+#include "timeseries.h"
+#include "www.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <optional>
+#include <vector>
+
+namespace
+{
+
+using timeseries::fields;
+
+struct sample
+{
+    int64_t time = 0; // start of the interval, in s since the epoch
+    std::array<timeseries::aggregate, fields.size()> values;
+};
+
+// The samples of one resolution, in a ring buffer that is allocated at startup, so memory use does not grow.
+struct level
+{
+    level(int64_t _resolution, std::size_t capacity) : resolution{_resolution}, samples{capacity} {}
+
+    void add(int64_t t, const core::budget& b, const core::situation& sit)
+    {
+        auto start = t - t % resolution;
+        if (start != current.time and pending_count > 0)
+            flush();
+        current.time = start;
+        pending_count++;
+        for (std::size_t i = 0; i < fields.size(); i++) {
+            pending[i].add(fields[i].get(b, sit));
+            current.values[i] = pending[i].get();
+        }
+    }
+
+    void flush()
+    {
+        samples.push(current);
+        pending = {};
+        pending_count = 0;
+    }
+
+    // number of samples, including the interval that is still being aggregated
+    std::size_t size() const { return samples.size() + (pending_count > 0); }
+
+    const sample& at(std::size_t i) const { return i < samples.size() ? samples[i] : current; }
+
+    const int64_t resolution; // s
+    timeseries::ring<sample> samples;
+    sample current; // the interval that is still being aggregated
+    std::size_t pending_count = 0;
+    std::array<timeseries::accumulator, fields.size()> pending;
+};
+
+struct query
+{
+    std::optional<int64_t> from; // s since the epoch, an hour before to by default
+    std::optional<int64_t> to; // s since the epoch, now by default
+    std::size_t points = 500; // maximum number of points per field
+    std::string fields; // comma separated, all by default
+};
+
+void from_json(const nlohmann::json& j, query& q)
+{
+    if (j.contains("from")) q.from = j.at("from").get<int64_t>();
+    if (j.contains("to")) q.to = j.at("to").get<int64_t>();
+    q.points = std::clamp<std::size_t>(j.value("points", q.points), 3, 10000);
+    q.fields = j.value("fields", q.fields);
+}
+
+struct history : core::consumer
+{
+    history() : core::consumer("history") {}
+
+    void handle(const core::budget& b, const core::situation& sit) override
+    {
+        auto t = now();
+        auto levels = m_levels.lock();
+        for (auto& l : *levels)
+            l.add(t, b, sit);
+    }
+
+    void get(const query& q, www::json_writer& out) const
+    {
+        auto to = q.to.value_or(now());
+        auto from = q.from.value_or(to - 3600);
+
+        std::vector<std::size_t> selected;
+        for (std::size_t i = 0; i < fields.size(); i++)
+            if (q.fields.empty() or timeseries::contains(q.fields, fields[i].name))
+                selected.push_back(i);
+
+        // a copy of the samples in range, so that downsampling and writing them does not hold up the tick, which adds
+        // samples under the same lock
+        int64_t resolution;
+        std::vector<int64_t> times;
+        std::vector<std::vector<timeseries::aggregate>> values(selected.size());
+        {
+            auto levels = m_levels.lock();
+            // the finest resolution that still goes back far enough
+            auto l = std::find_if(levels->begin(), levels->end(), [&](const level& l) {
+                return from >= now() - int64_t(l.samples.capacity()) * l.resolution;
+            });
+            if (l == levels->end())
+                l = std::prev(levels->end());
+
+            auto time = [&](std::size_t i) { return l->at(i).time; };
+            auto begin = timeseries::lower_bound(0, l->size(), from - from % l->resolution, time);
+            auto end = timeseries::lower_bound(begin, l->size(), to + 1, time);
+            resolution = l->resolution;
+            times.reserve(end - begin);
+            for (auto& v : values)
+                v.reserve(end - begin);
+            for (auto i = begin; i < end; i++) {
+                times.push_back(l->at(i).time);
+                for (std::size_t k = 0; k < selected.size(); k++)
+                    values[k].push_back(l->at(i).values[selected[k]]);
+            }
+        }
+
+        out.begin_object();
+        out.key("from"); out.value(from);
+        out.key("to"); out.value(to);
+        out.key("resolution"); out.value(resolution);
+        out.key("fields");
+        out.begin_object();
+        for (std::size_t k = 0; k < selected.size(); k++) {
+            auto& v = values[k];
+            auto picks = timeseries::lttb(times.size(), q.points,
+                    [&](std::size_t i) { return double(times[i]); },
+                    [&](std::size_t i) { return double(v[i].avg); });
+            out.key(fields[selected[k]].name);
+            out.begin_object();
+            out.key("time");
+            out.begin_array();
+            for (auto& p : picks)
+                out.value(times[p.index]);
+            out.end_array();
+            out.key("avg");
+            out.begin_array();
+            for (auto& p : picks)
+                out.value(v[p.index].avg);
+            out.end_array();
+            // the extremes of all the points a pick stands for, so that peaks do not disappear from a chart
+            out.key("min");
+            out.begin_array();
+            for (auto& p : picks) {
+                float lo = NAN;
+                for (auto i = p.begin; i < p.end; i++)
+                    lo = std::fmin(lo, v[i].min);
+                out.value(lo);
+            }
+            out.end_array();
+            out.key("max");
+            out.begin_array();
+            for (auto& p : picks) {
+                float hi = NAN;
+                for (auto i = p.begin; i < p.end; i++)
+                    hi = std::fmax(hi, v[i].max);
+                out.value(hi);
+            }
+            out.end_array();
+            out.end_object();
+        }
+        out.end_object();
+        out.end_object();
+    }
+
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // 1 s for an hour, 1 min for a day and 15 min for a year: about 4 MB in total
+    mutex_protected<std::array<level, 3>> m_levels{std::array<level, 3>{
+        level{1, 3600},
+        level{60, 1440},
+        level{900, 35040},
+    }};
+    www::rpc m_rpc = www::rpc::stream<query>("history", [this](const query& q, www::json_writer& out) {
+        get(q, out);
+    });
+} impl;
+
+} // anonymous namespace
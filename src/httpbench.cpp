@@ -0,0 +1,304 @@
+// p1faker-httpbench: loads the web server of a running p1faker with a realistic mix of requests over keep-alive
+// connections and reports throughput and latency. In jitter mode it also follows the monitor events, which the server
+// publishes once per tick of its control loop, to show whether web traffic delays the P1 output.
+//
+// Takes the same --option value arguments and p1faker.conf as p1faker itself, so it finds the server on www.bind_port
+// and knows its interval.
+
+#include "config.h"
+#include "logf.h"
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+namespace http = beast::http;
+using tcp = asio::ip::tcp;
+using namespace std::chrono_literals;
+
+namespace {
+
+config::param<std::string> host{"httpbench.host", "localhost"};
+config::param<std::string> port{"www.bind_port", "8008"}; // the same parameter the server listens on
+config::param<int> connections{"httpbench.connections", 8};
+config::param<int> duration{"httpbench.duration", 10}; // s, per phase
+config::param<std::string> mix{"httpbench.mix", "static=50,monitor=30,settings=15,post_settings=5"}; // relative weights
+config::param<bool> jitter{"httpbench.jitter", false}; // measure the tick jitter, first idle and then under load
+config::param<int> interval{"interval", 1000}; // ms between ticks of the control loop of the server
+
+struct kind {
+    std::string_view name;
+    http::verb method;
+    std::string_view target;
+};
+
+// what the UI does: load the page, poll the monitor and the settings, and now and then post settings, which the
+// benchmark keeps empty, so that it does not change or persist anything on a live system
+constexpr std::array kinds = {
+    kind{"static", http::verb::get, "/"},
+    kind{"monitor", http::verb::get, "/api/monitor"},
+    kind{"settings", http::verb::get, "/api/settings"},
+    kind{"post_settings", http::verb::post, "/api/settings"},
+};
+
+std::array<double, kinds.size()> parse_mix(std::string_view text) {
+    std::array<double, kinds.size()> weights{};
+    while (not text.empty()) {
+        auto item = text.substr(0, std::min(text.find(','), text.size()));
+        text.remove_prefix(std::min(item.size() + 1, text.size()));
+        auto eq = std::min(item.find('='), item.size());
+        auto it = std::find_if(kinds.begin(), kinds.end(), [&](const kind& k) { return k.name == item.substr(0, eq); });
+        if (it == kinds.end() or eq == item.size())
+            throw std::invalid_argument(str(boost::format("invalid item '%s' in httpbench.mix") % item));
+        weights[it - kinds.begin()] = std::stod(std::string{item.substr(eq + 1)});
+    }
+    if (std::all_of(weights.begin(), weights.end(), [](double w) { return w <= 0.0; }))
+        throw std::invalid_argument("httpbench.mix selects no requests");
+    return weights;
+}
+
+struct stats {
+    std::array<std::vector<float>, kinds.size()> latencies; // ms
+    std::array<std::size_t, kinds.size()> errors{}; // responses with status 4xx or 5xx
+    std::size_t failures = 0; // broken connections
+};
+
+http::response<http::string_body> fetch(tcp::socket& socket, beast::flat_buffer& buffer, http::request<http::string_body>& req) {
+    http::write(socket, req);
+    http::response<http::string_body> res;
+    http::read(socket, buffer, res);
+    return res;
+}
+
+// Sends requests over one keep-alive connection, one at a time like a browser tab, until stop is set
+void load(std::size_t id, const tcp::resolver::results_type& endpoints, const std::atomic<bool>& stop, stats& s) {
+    asio::io_context ioc;
+    tcp::socket socket{ioc};
+    beast::flat_buffer buffer;
+    std::mt19937 rng{unsigned(id)};
+    auto weights = parse_mix(*mix);
+    std::discrete_distribution<std::size_t> pick{weights.begin(), weights.end()};
+
+    while (not stop) {
+        auto k = pick(rng);
+        beast::string_view target{kinds[k].target.data(), kinds[k].target.size()};
+        http::request<http::string_body> req{kinds[k].method, target, 11};
+        req.set(http::field::host, *host);
+        req.set(http::field::accept_encoding, "gzip");
+        if (kinds[k].method == http::verb::post) {
+            req.set(http::field::content_type, "application/json");
+            req.body() = "{}";
+        }
+        req.prepare_payload();
+        try {
+            if (not socket.is_open()) {
+                asio::connect(socket, endpoints);
+                socket.set_option(tcp::no_delay{true});
+                buffer.clear();
+            }
+            auto t0 = std::chrono::steady_clock::now();
+            auto res = fetch(socket, buffer, req);
+            s.latencies[k].push_back(std::chrono::duration<float, std::milli>{std::chrono::steady_clock::now() - t0}.count());
+            if (res.result_int() >= 400)
+                s.errors[k]++;
+            if (not res.keep_alive())
+                socket.close();
+        } catch (boost::system::system_error& e) {
+            logfdebug("Connection %d failed: %s", id, e.what());
+            s.failures++;
+            boost::system::error_code ec;
+            socket.close(ec);
+            std::this_thread::sleep_for(100ms);
+        }
+    }
+}
+
+// Follows GET /api/events and records the time stamp of each monitor event, until stop is set
+void follow(const tcp::resolver::results_type& endpoints, const std::atomic<bool>& stop, std::vector<int64_t>& times) {
+    asio::io_context ioc;
+    tcp::socket socket{ioc};
+    asio::connect(socket, endpoints);
+    http::request<http::empty_body> req{http::verb::get, "/api/events", 11};
+    req.set(http::field::host, *host);
+    http::write(socket, req);
+
+    beast::flat_buffer buffer;
+    http::response_parser<http::empty_body> parser;
+    parser.skip(true); // the body is read as a stream of events below
+    http::read_header(socket, buffer, parser);
+    std::string data{static_cast<const char*>(buffer.data().data()), buffer.size()};
+
+    bool first = true; // the current state on subscription, which is not a tick
+    while (not stop) {
+        auto n = asio::read_until(socket, asio::dynamic_buffer(data), "\n\n");
+        std::string_view event{data.data(), n};
+        if (event.starts_with("event: monitor\n")) {
+            auto pos = event.find("data: ");
+            auto j = nlohmann::json::parse(event.substr(pos + 6));
+            if (not first and j.contains("time"))
+                times.push_back(j["time"].get<int64_t>());
+            first = false;
+        }
+        data.erase(0, n);
+    }
+}
+
+// Waits for the given time, or until interrupted: config.cpp blocks SIGINT and SIGTERM for all threads
+bool wait_for(std::chrono::seconds t) {
+    sigset_t sigset = {};
+    sigaddset(&sigset, SIGTERM);
+    sigaddset(&sigset, SIGINT);
+    timespec ts = {decltype(ts.tv_sec)(t.count()), 0};
+    return sigtimedwait(&sigset, nullptr, &ts) < 0;
+}
+
+template<typename T>
+double percentile(const std::vector<T>& sorted, double p) {
+    if (sorted.empty())
+        return NAN;
+    return sorted[std::min(sorted.size() - 1, std::size_t(p / 100.0 * sorted.size()))];
+}
+
+template<typename T>
+void print_row(std::string_view name, std::vector<T> values, const std::string& extra) {
+    std::sort(values.begin(), values.end());
+    std::cout << boost::format("%-14s %8d%s %8.2f %8.2f %8.2f %8.2f %8.2f\n") % name % values.size() % extra
+            % percentile(values, 50) % percentile(values, 90) % percentile(values, 99) % percentile(values, 99.9)
+            % (values.empty() ? NAN : double(values.back()));
+}
+
+void print_load(const std::vector<stats>& all, double seconds) {
+    std::cout << boost::format("\n%-14s %8s %8s %8s %8s %8s %8s %8s %8s (ms)\n")
+            % "request" % "count" % "errors" % "req/s" % "p50" % "p90" % "p99" % "p99.9" % "max";
+    std::vector<float> total;
+    std::size_t total_errors = 0, failures = 0;
+    for (std::size_t k = 0; k < kinds.size(); k++) {
+        std::vector<float> latencies;
+        std::size_t errors = 0;
+        for (auto& s : all) {
+            latencies.insert(latencies.end(), s.latencies[k].begin(), s.latencies[k].end());
+            errors += s.errors[k];
+        }
+        if (latencies.empty() and errors == 0)
+            continue;
+        total.insert(total.end(), latencies.begin(), latencies.end());
+        total_errors += errors;
+        print_row(kinds[k].name, latencies, str(boost::format(" %8d %8.1f") % errors % (latencies.size() / seconds)));
+    }
+    for (auto& s : all)
+        failures += s.failures;
+    print_row("total", total, str(boost::format(" %8d %8.1f") % total_errors % (total.size() / seconds)));
+    if (failures > 0)
+        std::cout << failures << " requests failed on a broken connection\n";
+}
+
+// How much later or sooner than the interval each tick came after the previous one
+std::vector<int64_t> deviations(const std::vector<int64_t>& times) {
+    std::vector<int64_t> result;
+    for (std::size_t i = 1; i < times.size(); i++)
+        result.push_back(std::abs(times[i] - times[i - 1] - *interval));
+    return result;
+}
+
+} // anonymous namespace
+
+int main(int argc, const char **argv) {
+    while (++argv, --argc) {
+        if (std::strncmp(*argv, "--", 2) or argc < 2) {
+            std::cerr << "Usage: p1faker-httpbench [--option value]*\n\n"
+                         "Options: httpbench.host, www.bind_port, httpbench.connections, httpbench.duration (s),\n"
+                         "         httpbench.mix (e.g. static=50,monitor=30,settings=15,post_settings=5),\n"
+                         "         httpbench.jitter (0 or 1), interval (ms)\n";
+            return -1;
+        }
+        const char* name = &(*argv)[2];
+        argv++, argc--;
+        config::set_param(name, *argv);
+    }
+
+    try {
+        parse_mix(*mix);
+    } catch (std::exception& e) {
+        logferror("%s", e.what());
+        return -1;
+    }
+
+    tcp::resolver::results_type endpoints;
+    try {
+        asio::io_context ioc;
+        endpoints = tcp::resolver{ioc}.resolve(*host, *port);
+        tcp::socket socket{ioc};
+        asio::connect(socket, endpoints);
+    } catch (std::exception& e) {
+        logferror("Failed to reach p1faker at %s:%s: %s", *host, *port, e.what());
+        return 1;
+    }
+
+    std::atomic<bool> stop = false;
+    std::vector<int64_t> idle_ticks, loaded_ticks;
+    std::optional<std::thread> follower;
+    auto start_following = [&](std::vector<int64_t>& times) {
+        follower.emplace([&] {
+            try {
+                follow(endpoints, stop, times);
+            } catch (std::exception& e) {
+                logferror("Failed to follow the events of p1faker: %s", e.what());
+            }
+        });
+    };
+
+    bool interrupted = false;
+    if (jitter) {
+        std::cout << "Measuring tick jitter without load for " << *duration << " s" << std::endl;
+        start_following(idle_ticks);
+        interrupted = not wait_for(std::chrono::seconds{*duration});
+        stop = true;
+        follower->join();
+        stop = false;
+    }
+
+    std::vector<stats> all(connections);
+    if (not interrupted) {
+        std::cout << "Loading " << *host << ":" << *port << " over " << *connections << " connections for "
+                << *duration << " s" << std::endl;
+        if (jitter)
+            start_following(loaded_ticks);
+        auto t0 = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (std::size_t i = 0; i < all.size(); i++)
+            workers.emplace_back([&, i] { load(i, endpoints, stop, all[i]); });
+        wait_for(std::chrono::seconds{*duration});
+        stop = true;
+        for (auto& w : workers)
+            w.join();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t0;
+        if (follower and follower->joinable())
+            follower->join();
+        print_load(all, elapsed.count());
+    }
+
+    if (jitter) {
+        std::cout << boost::format("\n%-14s %8s %8s %8s %8s %8s %8s (ms from the interval of %d ms)\n")
+                % "tick jitter" % "ticks" % "p50" % "p90" % "p99" % "p99.9" % "max" % *interval;
+        print_row("idle", deviations(idle_ticks), "");
+        print_row("loaded", deviations(loaded_ticks), "");
+    }
+}
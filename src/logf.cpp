@@ -1,8 +1,16 @@
 #include "logf.h"
 #include "config.h"
+#include "mutex_protected.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <time.h>
 #include <syslog.h>
 
@@ -24,15 +32,468 @@ std::istream& logseverity::operator>>(std::istream& is, logseverity::type& v) {
     return is;
 }
 
-msgdef::msgdef(logseverity::type _sev, const char* _file, int _line, const char* _fmt)
-: sev(_sev), file(_file), line(_line), fmt(_fmt) {}
+// The call sites that have been reached, linked through msgdef::m_next, and the verbosity they follow
+struct logdetail::callsites {
+    static auto lock() {
+        static mutex_protected<callsites> instance;
+        return instance.lock();
+    }
+
+    struct override {
+        std::string file; // end of the path
+        int line; // 0 for all lines
+        logseverity::type verbosity;
+
+        bool matches(const msgdef& def) const {
+            std::string_view path{def.file};
+            return (line == 0 or line == def.line) and path.ends_with(file)
+                    and (path.size() == file.size() or path[path.size() - file.size() - 1] == '/');
+        }
+    };
+
+    msgdef* first = nullptr;
+    std::vector<override> overrides; // the last one that matches counts
+    logseverity::type global = logseverity::info;
+
+    std::optional<logseverity::type> verbosity(const msgdef& def) const {
+        for (auto it = overrides.rbegin(); it != overrides.rend(); ++it)
+            if (it->matches(def))
+                return it->verbosity;
+        return std::nullopt;
+    }
+
+    void update(msgdef& def) const {
+        def.m_state.store(def.sev <= verbosity(def).value_or(global) ? msgdef::on : msgdef::off, std::memory_order_relaxed);
+    }
+
+    void update_all() const {
+        for (auto* def = first; def; def = def->m_next)
+            update(*def);
+    }
+
+    // the call sites that suppressed messages since the previous call, with the count
+    std::vector<std::pair<const msgdef*, uint32_t>> take_suppressed() const;
+
+    std::vector<callsite> list() const {
+        std::vector<callsite> result;
+        for (auto* def = first; def; def = def->m_next)
+            result.push_back(callsite{def->file, def->line, def->sev, def->fmt, verbosity(*def),
+                    def->m_state.load(std::memory_order_relaxed) == msgdef::on});
+        return result;
+    }
+};
+
+namespace {
+
+// A param that calls back when it changes. The callback hands the value over to the threads that log, so it may be
+// reloaded while running.
+template<typename T>
+struct watched_param : config::param<T> {
+    watched_param(std::string_view name, T default_value, std::function<void()> changed)
+    : config::param<T>{name, default_value, config::reloadable}, m_changed{std::move(changed)} {}
+
+protected:
+    std::string parse(std::string_view text) override {
+        auto result = config::param<T>::parse(text);
+        m_changed();
+        return result;
+    }
+
+private:
+    std::function<void()> m_changed;
+};
 
-bool msgdef::shouldlog() const {
-    static config::param<logseverity::type> verbosity{"verbosity", logseverity::info};
-    return sev <= verbosity.get();
+// Enables and disables the call sites when it changes. Only callsites::global is read elsewhere.
+void configure_verbosity() {
+    static watched_param<logseverity::type> verbosity{"verbosity", logseverity::info, [] {
+        auto c = callsites::lock();
+        c->global = verbosity.get();
+        c->update_all();
+    }};
+    static bool initialized = (callsites::lock()->global = verbosity.get(), true);
+    (void)initialized;
 }
 
-void msgdef::dolog(std::string msg) {
+// The rate limit of the call sites of a severity: a token bucket that lets a burst of messages through and then a
+// steady rate. Each call site keeps it as the time at which its bucket is full again (GCRA), in msgdef::m_tat.
+struct rate_limit {
+    std::atomic<int64_t> interval = 0; // ns between messages at the steady rate, 0 for no limit
+    std::atomic<int64_t> tolerance = 0; // ns that the bucket may be ahead of now, for the burst
+};
+constinit std::array<rate_limit, logseverity::extra + 1> rate_limits;
+
+// whether call sites have suppressed messages that were not reported yet
+constinit std::atomic<bool> suppressing = false;
+
+void wake_backend(); // so that it reports suppressed messages, also when no other messages come
+
+// log.<severity>.rate in messages per minute for each call site, 0 for no limit, after a burst of log.<severity>.burst
+struct rate_params {
+    rate_params(logseverity::type _sev, double rate, int burst)
+    : sev{_sev}
+    , m_rate{name("rate"), rate, [this] { update(); }}
+    , m_burst{name("burst"), burst, [this] { update(); }} {
+        update();
+    }
+
+    std::string name(std::string_view what) const {
+        return str(boost::format("log.%s.%s") % sev % what);
+    }
+
+    void update() {
+        auto interval = m_rate.get() > 0.0 ? int64_t(60e9 / m_rate.get()) : 0;
+        rate_limits[sev].interval.store(interval, std::memory_order_relaxed);
+        rate_limits[sev].tolerance.store(interval * std::max(0, m_burst.get() - 1), std::memory_order_relaxed);
+    }
+
+    const logseverity::type sev;
+    watched_param<double> m_rate;
+    watched_param<int> m_burst;
+};
+
+// Error storms, like those of an inverter that went offline, should not fill the SD card. Panics are never limited.
+void configure_rate_limits() {
+    static rate_params error{logseverity::error, 6, 10}, warn{logseverity::warn, 6, 10}, info{logseverity::info, 30, 20},
+            debug{logseverity::debug, 0, 0}, extra{logseverity::extra, 0, 0};
+}
+
+int64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // anonymous namespace
+
+bool msgdef::enroll() {
+    // constructing the verbosity param may log, which must not construct it once more
+    static thread_local bool busy = false;
+    if (busy)
+        return false;
+    busy = true;
+    configure_verbosity();
+    configure_rate_limits();
+    busy = false;
+
+    auto c = callsites::lock();
+    if (m_state.load(std::memory_order_relaxed) == unknown) { // not enrolled by another thread meanwhile
+        m_next = c->first;
+        c->first = this;
+    }
+    c->update(*this);
+    return m_state.load(std::memory_order_relaxed) == on;
+}
+
+std::vector<std::pair<const msgdef*, uint32_t>> callsites::take_suppressed() const {
+    std::vector<std::pair<const msgdef*, uint32_t>> result;
+    for (auto* def = first; def; def = def->m_next)
+        if (auto count = def->m_suppressed.exchange(0, std::memory_order_relaxed))
+            result.emplace_back(def, count);
+    return result;
+}
+
+bool msgdef::admit() {
+    auto& limit = rate_limits[sev];
+    auto interval = limit.interval.load(std::memory_order_relaxed);
+    if (interval == 0)
+        return true;
+    auto tolerance = limit.tolerance.load(std::memory_order_relaxed);
+    auto now = steady_ns();
+    auto tat = m_tat.load(std::memory_order_relaxed);
+    int64_t next;
+    do {
+        auto t = std::max(tat, now);
+        if (t - now > tolerance) {
+            m_suppressed.fetch_add(1, std::memory_order_relaxed);
+            if (not suppressing.exchange(true, std::memory_order_relaxed))
+                wake_backend();
+            return false;
+        }
+        next = t + interval;
+    } while (not m_tat.compare_exchange_weak(tat, next, std::memory_order_relaxed));
+    return true;
+}
+
+std::vector<callsite> logdetail::list_callsites() {
+    return callsites::lock()->list();
+}
+
+void logdetail::set_verbosity(std::string_view file, int line, std::optional<logseverity::type> verbosity) {
+    auto c = callsites::lock();
+    std::erase_if(c->overrides, [&](const callsites::override& o) { return o.file == file and o.line == line; });
+    if (verbosity)
+        c->overrides.push_back(callsites::override{std::string{file}, line, *verbosity});
+    c->update_all();
+}
+
+namespace {
+
+// Bounded queue of records from any thread to the logging thread (Vyukov), without locks: a message costs the caller
+// a copy of its arguments, not the formatting and the write.
+class queue {
+public:
+    static constexpr std::size_t size = 512; // records, about 128 kB
+
+    queue() {
+        for (std::size_t i = 0; i < size; i++)
+            m_slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // false if the queue is full
+    bool push(const record& r) {
+        auto pos = m_head.load(std::memory_order_relaxed);
+        while (true) {
+            auto& slot = m_slots[pos % size];
+            auto diff = intptr_t(slot.sequence.load(std::memory_order_acquire)) - intptr_t(pos);
+            if (diff < 0)
+                return false;
+            if (diff > 0)
+                pos = m_head.load(std::memory_order_relaxed);
+            else if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.r = r;
+                slot.sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+    }
+
+    // only called by the logging thread
+    bool pop(record& r) {
+        auto pos = m_tail.load(std::memory_order_relaxed);
+        auto& slot = m_slots[pos % size];
+        if (slot.sequence.load(std::memory_order_acquire) != pos + 1)
+            return false;
+        r = slot.r;
+        slot.sequence.store(pos + size, std::memory_order_release);
+        m_tail.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const { return m_tail.load(std::memory_order_acquire) == m_head.load(std::memory_order_acquire); }
+
+private:
+    struct slot {
+        std::atomic<std::size_t> sequence;
+        record r;
+    };
+    std::array<slot, size> m_slots;
+    alignas(64) std::atomic<std::size_t> m_head = 0; // next to push
+    alignas(64) std::atomic<std::size_t> m_tail = 0; // next to pop
+};
+
+// Formats and writes the records from the queue. When the queue is full, new messages are dropped and counted, so
+// that logging never waits; the count is logged once there is room again. A message that is the same as the previous
+// one from its call site is not written but counted, as syslogd does, and so are the messages that a rate limit
+// suppressed. The counts are written when another message comes from the call site, or log.repeat_window later.
+// threads that found the backend and may still be using it, which its destructor waits for
+constinit std::atomic<int> using_backend = 0;
+
+class backend {
+public:
+    static std::atomic<backend*> instance; // null when not running, i.e. during static destruction
+
+    backend() : m_thread{[this] { run(); }} { instance = this; }
+
+    ~backend() {
+        instance = nullptr;
+        while (using_backend.load() > 0) // found the instance just before, so they may still push a record
+            std::this_thread::yield();
+        {
+            std::lock_guard lock{m_mutex};
+            m_stop = true;
+        }
+        m_wake.notify_one();
+        m_thread.join(); // only returns once the queue is empty
+    }
+
+    void push(const record& r) {
+        if (not m_queue.push(r)) {
+            delete r.formatted;
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        wake();
+    }
+
+    // Wakes up the logging thread if it is waiting. Only takes the mutex then, so that a busy thread does not
+    // slow down the ones that log.
+    void wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst); // orders the push before the check, see wait()
+        if (m_waiting.load(std::memory_order_relaxed)) {
+            std::lock_guard lock{m_mutex};
+            m_wake.notify_one();
+        }
+    }
+
+    // waits a while for what is in the queue to be written, before a panic ends the process
+    void flush() {
+        for (int i = 0; i < 100 and not m_queue.empty(); i++)
+            std::this_thread::sleep_for(10ms);
+    }
+
+private:
+    struct history {
+        std::string msg; // the last message from the call site that was written
+        std::size_t repeated = 0; // times the same message came since, not written
+        std::size_t suppressed = 0; // by the rate limit, since
+        std::chrono::steady_clock::time_point since; // of the first that was not written
+        std::chrono::system_clock::time_point time; // of the last that was not written
+    };
+
+    // Waits for a message, or until the next sweep if there is something to report then
+    void wait(std::chrono::steady_clock::time_point swept) {
+        std::unique_lock lock{m_mutex};
+        m_waiting.store(true, std::memory_order_relaxed);
+        // either wake() sees m_waiting, or this sees what it was called for
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_queue.empty() and not m_stop) {
+            bool pending = suppressing.load(std::memory_order_relaxed) or std::any_of(m_history.begin(), m_history.end(),
+                    [](const auto& entry) { return entry.second.repeated + entry.second.suppressed > 0; });
+            if (pending)
+                m_wake.wait_until(lock, swept + 1s);
+            else
+                m_wake.wait(lock);
+        }
+        m_waiting.store(false, std::memory_order_relaxed);
+    }
+
+    void run() {
+        auto swept = std::chrono::steady_clock::now();
+        while (true) {
+            bool stop = m_stop;
+            record r;
+            while (m_queue.pop(r)) {
+                write(r.def, r.time, r.def->format(r), r.suppressed);
+                delete r.formatted;
+            }
+            if (auto dropped = m_dropped.exchange(0, std::memory_order_relaxed))
+                logfwarn("Dropped %d log messages, because they came in faster than they could be written", dropped);
+            auto now = std::chrono::steady_clock::now();
+            if (now - swept >= 1s or stop) {
+                swept = now;
+                if (suppressing.exchange(false, std::memory_order_relaxed)) {
+                    auto suppressed = callsites::lock()->take_suppressed();
+                    for (auto [def, count] : suppressed)
+                        skip(m_history[def], std::chrono::system_clock::now(), 0, count);
+                }
+                for (auto& [def, h] : m_history)
+                    if (now - h.since >= std::chrono::seconds{*m_repeat_window} or stop)
+                        summarize(def, h);
+            }
+            if (stop and m_queue.empty())
+                break;
+            wait(swept);
+        }
+    }
+
+    void write(const msgdef* def, std::chrono::system_clock::time_point time, std::string msg, uint32_t suppressed) {
+        auto& h = m_history[def];
+        if (msg == h.msg and *m_repeat_window > 0)
+            return skip(h, time, 1, suppressed);
+        skip(h, time, 0, suppressed);
+        summarize(def, h);
+        def->write(time, msg);
+        h.msg = std::move(msg);
+    }
+
+    void skip(history& h, std::chrono::system_clock::time_point time, std::size_t repeated, std::size_t suppressed) {
+        if (repeated + suppressed == 0)
+            return;
+        if (h.repeated + h.suppressed == 0)
+            h.since = std::chrono::steady_clock::now();
+        h.repeated += repeated;
+        h.suppressed += suppressed;
+        h.time = time;
+    }
+
+    void summarize(const msgdef* def, history& h) {
+        if (h.repeated > 0 and h.suppressed > 0)
+            def->write(h.time, str(boost::format("last message repeated %d times, and %d messages from here were "
+                    "suppressed because they came too fast") % h.repeated % h.suppressed));
+        else if (h.repeated > 0)
+            def->write(h.time, str(boost::format("last message repeated %d times") % h.repeated));
+        else if (h.suppressed > 0)
+            def->write(h.time, str(boost::format("%d messages from here were suppressed because they came too fast")
+                    % h.suppressed));
+        h.repeated = h.suppressed = 0;
+    }
+
+    config::param<int> m_repeat_window{"log.repeat_window", 30}; // s, 0 to write repeated messages anyway
+    std::unordered_map<const msgdef*, history> m_history; // only used by the logging thread
+    queue m_queue;
+    std::atomic<std::size_t> m_dropped = 0;
+    std::atomic<bool> m_stop = false;
+    std::atomic<bool> m_waiting = false; // in wait()
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::thread m_thread;
+};
+
+std::atomic<backend*> backend::instance = nullptr;
+
+void wake_backend() {
+    using_backend.fetch_add(1);
+    if (auto* b = backend::instance.load())
+        b->wake();
+    using_backend.fetch_sub(1);
+}
+
+} // anonymous namespace
+
+void msgdef::push(record& r) {
+    static backend started; // on the first message
+    if (m_suppressed.load(std::memory_order_relaxed))
+        r.suppressed = m_suppressed.exchange(0, std::memory_order_relaxed);
+    using_backend.fetch_add(1);
+    auto* b = backend::instance.load();
+    if (b and sev != logseverity::panic) {
+        b->push(r);
+        using_backend.fetch_sub(1);
+        return;
+    }
+    if (b)
+        b->flush();
+    using_backend.fetch_sub(1);
+    write(r.time, format(r));
+    delete r.formatted;
+    if (sev == logseverity::panic)
+        std::abort();
+}
+
+std::string msgdef::format(const record& r) const {
+    std::string msg;
+    if (r.formatted) {
+        msg = *r.formatted;
+    } else {
+        try {
+            boost::format f{fmt};
+            for (std::size_t pos = 0; pos < r.size; ) {
+                auto t = record::tag(r.args[pos++]);
+                auto get = [&](auto v) {
+                    std::memcpy(&v, &r.args[pos], sizeof v);
+                    pos += sizeof v;
+                    return v;
+                };
+                switch (t) {
+                case record::i64: f % get(int64_t{}); break;
+                case record::u64: f % get(uint64_t{}); break;
+                case record::f64: f % get(double{}); break;
+                case record::boolean: f % bool(get(char{})); break;
+                case record::character: f % get(char{}); break;
+                case record::string: {
+                    auto n = get(uint32_t{});
+                    f % std::string_view{&r.args[pos], n};
+                    pos += n;
+                    break;
+                }
+                }
+            }
+            msg = str(f);
+        } catch (std::exception& e) {
+            msg = str(boost::format("formatting '%s' failed: %s") % fmt % e.what());
+        }
+    }
+    return msg;
+}
+
+void msgdef::write(std::chrono::system_clock::time_point time, const std::string& msg) const {
     static config::param<bool> use_syslog{"use_syslog", false};
     //static bool use_syslog = false;
     if (use_syslog) {
@@ -45,7 +506,7 @@ void msgdef::dolog(std::string msg) {
                 *(severity_labels.begin() + sev), file, line, msg.c_str());
     } else {
         struct tm tm;
-        auto tp = std::chrono::system_clock::now();
+        auto tp = time;
         auto tt = std::chrono::system_clock::to_time_t(tp);
         localtime_r(&tt, &tm);
         std::cerr << boost::format("%04d-%02d-%02d %02d:%02d:%02d.%03d %s [%s] [%s:%d] %s\n")
@@ -53,6 +514,4 @@ void msgdef::dolog(std::string msg) {
                 % tm.tm_hour % tm.tm_min % tm.tm_sec % (tp.time_since_epoch() % 1s / 1ms) % tm.tm_zone
                 % sev % file % line % msg;
     }
-    if (sev == logseverity::panic)
-        std::abort();
 }
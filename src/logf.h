@@ -3,7 +3,19 @@
 
 #include <cmath>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
 #include <iostream>
+#include <optional>
+#include <sstream>
+#include <string_view>
+#include <type_traits>
+#include <vector>
 #include <boost/format.hpp>
 
 namespace logseverity {
@@ -20,26 +32,222 @@ std::istream& operator>>(std::istream& is, type& v);
 }
 
 namespace logdetail {
+struct msgdef;
+struct callsites;
+
+// A message on its way to the logging thread: the call site, the time and the arguments in binary form, to be formatted
+// over there. Arguments that are not numbers or strings are formatted to a string right away.
+struct record {
+    enum tag : char { i64, u64, f64, boolean, character, string };
+    static constexpr std::size_t capacity = 224; // bytes of arguments
+
+    const msgdef* def = nullptr;
+    std::chrono::system_clock::time_point time;
+    std::string* formatted = nullptr; // the complete message, if the arguments did not fit
+    uint32_t suppressed = 0; // messages from the call site that were suppressed since the previous one
+    uint16_t size = 0;
+    bool overflow = false;
+    std::array<char, capacity> args;
+
+    template<typename T>
+    void add(const T& v) {
+        using U = std::decay_t<T>;
+        if constexpr (std::is_same_v<U, bool>)
+            put(boolean, char(v));
+        else if constexpr (std::is_same_v<U, char> or std::is_same_v<U, signed char> or std::is_same_v<U, unsigned char>)
+            put(character, char(v));
+        else if constexpr (std::is_integral_v<U> and std::is_signed_v<U>)
+            put(i64, int64_t(v));
+        else if constexpr (std::is_integral_v<U>)
+            put(u64, uint64_t(v));
+        else if constexpr (std::is_floating_point_v<U>)
+            put(f64, double(v));
+        else if constexpr (std::is_convertible_v<const T&, std::string_view>)
+            put_string(std::string_view{v});
+        else {
+            std::ostringstream os;
+            os << v;
+            put_string(os.str());
+        }
+    }
+
+private:
+    template<typename T>
+    void put(tag t, const T& v) {
+        if (size + 1 + sizeof v > capacity)
+            return void(overflow = true);
+        args[size++] = t;
+        std::memcpy(&args[size], &v, sizeof v);
+        size += sizeof v;
+    }
+
+    void put_string(std::string_view v) {
+        put(string, uint32_t(v.size()));
+        if (overflow or size + v.size() > capacity)
+            return void(overflow = true);
+        std::memcpy(&args[size], v.data(), v.size());
+        size += v.size();
+    }
+};
+
+// The call site of a logf macro. Constant-initialized, so that a disabled one costs a single branch and no guard.
 struct msgdef {
-    msgdef(logseverity::type, const char*, int, const char*);
+    constexpr msgdef(logseverity::type _sev, const char* _file, int _line, const char* _fmt)
+    : sev(_sev), file(_file), line(_line), fmt(_fmt) {}
+
+    bool enabled() {
+        auto state = m_state.load(std::memory_order_relaxed);
+        if (state == off) [[likely]]
+            return false;
+        return state == on or enroll();
+    }
 
     template<typename... Args>
-    void trylog(Args&&... args) {
-        if (not shouldlog()) return;
-        try {
-            dolog(str((boost::format(fmt) % ... % args)));
-        } catch (std::exception& e) {
-            dolog(str(boost::format("formatting '%s' failed: %s") % fmt % e.what()));
+    void capture(const Args&... args) {
+        if (not admit())
+            return;
+        record r;
+        r.def = this;
+        r.time = std::chrono::system_clock::now();
+        (r.add(args), ...);
+        if (r.overflow) {
+            try {
+                r.formatted = new std::string{str((boost::format(fmt) % ... % args))};
+            } catch (std::exception& e) {
+                r.formatted = new std::string{str(boost::format("formatting '%s' failed: %s") % fmt % e.what())};
+            }
         }
+        push(r);
     }
+
+    // formats a record, on the logging thread
+    std::string format(const record& r) const;
+
+    // writes a message from this call site to stderr or syslog
+    void write(std::chrono::system_clock::time_point time, const std::string& msg) const;
+
+    const logseverity::type sev;
+    const char* const file;
+    const int line;
+    const char* const fmt;
+
 private:
-    bool shouldlog() const;
-    void dolog(std::string msg);
-    logseverity::type sev; const char* file; int line; const char* fmt;
+    friend struct callsites;
+    enum state : uint8_t { unknown, off, on };
+
+    bool enroll(); // adds the call site to the table, on its first call; returns whether it is enabled
+    bool admit(); // whether the rate limit of the severity lets a message through, counting it as suppressed if not
+    void push(record& r);
+
+    std::atomic<uint8_t> m_state = unknown;
+    std::atomic<int64_t> m_tat = 0; // ns on the steady clock at which the token bucket is full again
+    std::atomic<uint32_t> m_suppressed = 0; // since the last message that was let through
+    msgdef* m_next = nullptr; // in the table of call sites
 };
+
+// Calling one of these in a consteval function makes the compiler name the problem with the format string
+void format_string_has_an_invalid_directive();
+void format_string_has_more_directives_than_arguments();
+void format_string_has_fewer_directives_than_arguments();
+void format_string_has_a_numeric_directive_for_a_string();
+
+template<typename T>
+constexpr bool is_string = std::is_convertible_v<const T&, std::string_view>;
+
+// Checks a boost::format string against the arguments: the number of arguments it takes, and no strings for %d and such
+consteval void check_format(std::string_view f, std::initializer_list<bool> strings) {
+    auto is_digit = [](char c) { return c >= '0' and c <= '9'; };
+    std::size_t sequential = 0, positional = 0;
+    for (std::size_t i = 0; i < f.size(); i++) {
+        if (f[i] != '%')
+            continue;
+        if (++i == f.size())
+            format_string_has_an_invalid_directive();
+        if (f[i] == '%')
+            continue;
+        bool bars = f[i] == '|'; // %|spec|
+        if (bars)
+            i++;
+        std::size_t n = 0, j = i;
+        while (j < f.size() and is_digit(f[j]))
+            n = n * 10 + (f[j++] - '0');
+        if (j > i and j < f.size() and f[j] == '%' and not bars) { // %N%
+            positional = std::max(positional, n);
+            i = j;
+            continue;
+        }
+        std::size_t index = sequential;
+        if (j > i and j < f.size() and f[j] == '$') { // %N$spec
+            positional = std::max(positional, n);
+            index = n - 1;
+            i = j + 1;
+        } else {
+            sequential++;
+        }
+        while (i < f.size() and std::string_view{"-+ #0'"}.find(f[i]) != std::string_view::npos)
+            i++;
+        while (i < f.size() and (is_digit(f[i]) or f[i] == '.'))
+            i++;
+        while (i < f.size() and std::string_view{"hlLqjzt"}.find(f[i]) != std::string_view::npos)
+            i++;
+        if (i == f.size())
+            format_string_has_an_invalid_directive();
+        bool number = false;
+        if (std::string_view{"diouxXeEfFgGaAc"}.find(f[i]) != std::string_view::npos)
+            number = true;
+        else if (f[i] == '|' and bars)
+            i--; // %|5|: only a width, the conversion of the argument itself
+        else if (f[i] != 's' and f[i] != 'S')
+            format_string_has_an_invalid_directive();
+        if (bars and (++i == f.size() or f[i] != '|'))
+            format_string_has_an_invalid_directive();
+        if (number and index < strings.size() and strings.begin()[index])
+            format_string_has_a_numeric_directive_for_a_string();
+    }
+    auto needed = std::max(sequential, positional);
+    if (needed > strings.size())
+        format_string_has_more_directives_than_arguments();
+    if (needed < strings.size())
+        format_string_has_fewer_directives_than_arguments();
+}
+
+// A format string literal that was checked at compile time against the types of the arguments it is used with
+template<typename... Args>
+struct format_string {
+    consteval format_string(const char* s) : fmt(s) { check_format(s, {is_string<Args>...}); }
+    const char* fmt;
+};
+
+template<typename... Args>
+void log(msgdef& def, format_string<std::type_identity_t<Args>...>, const Args&... args) {
+    def.capture(args...);
+}
+
+/** A call site that has been reached, with the verbosity it follows. */
+struct callsite {
+    const char* file;
+    int line;
+    logseverity::type sev;
+    const char* fmt;
+    std::optional<logseverity::type> verbosity; // of the call site itself, instead of the global one
+    bool enabled;
+};
+
+/** The call sites that have been reached so far, in no particular order. */
+std::vector<callsite> list_callsites();
+
+/**
+ * Overrides the global verbosity for the call sites in files that end with file, at the given line or all lines if 0,
+ * including the ones that are yet to be reached. Without verbosity, they follow the global verbosity again.
+ */
+void set_verbosity(std::string_view file, int line, std::optional<logseverity::type> verbosity);
 }
 
-#define __logf(sev, fmt, ...) [&] { static logdetail::msgdef msgdef{sev, __FILE__, __LINE__, fmt}; msgdef.trylog(__VA_ARGS__); }()
+#define __logf(sev, fmt, ...) [&] { \
+    static constinit logdetail::msgdef msgdef{sev, __FILE__, __LINE__, fmt}; \
+    if (msgdef.enabled()) \
+        logdetail::log(msgdef, fmt __VA_OPT__(,) __VA_ARGS__); \
+}()
 #define logfpanic(fmt...) __logf(logseverity::panic, fmt)
 #define logferror(fmt...) __logf(logseverity::error, fmt)
 #define logfwarn(fmt...)  __logf(logseverity::warn , fmt)
@@ -0,0 +1,68 @@
+#include "metrics.h"
+#include "mutex_protected.h"
+
+#include <charconv>
+#include <cmath>
+#include <map>
+
+using namespace metrics;
+
+namespace {
+
+struct registry {
+    static auto lock() {
+        static mutex_protected<registry> instance;
+        return instance.lock();
+    }
+
+    // by name, so that the samples of a metric with different labels follow each other
+    std::multimap<std::string_view, metric*> metrics;
+};
+
+void append(std::string& out, double value) {
+    if (std::isnan(value))
+        out += "NaN";
+    else if (std::isinf(value))
+        out += value > 0 ? "+Inf" : "-Inf";
+    else {
+        char buffer[32];
+        auto [end, ec] = std::to_chars(buffer, buffer + sizeof buffer, value);
+        out.append(buffer, end);
+    }
+}
+
+} // anonymous namespace
+
+metric::metric(type kind, std::string_view name, std::string_view help, std::string_view labels)
+: m_type(kind), m_name(name), m_help(help), m_labels(labels) {
+    registry::lock()->metrics.emplace(m_name, this);
+}
+
+metric::~metric() {
+    auto reg = registry::lock();
+    auto [begin, end] = reg->metrics.equal_range(m_name);
+    for (auto it = begin; it != end; ++it) {
+        if (it->second == this) {
+            reg->metrics.erase(it);
+            break;
+        }
+    }
+}
+
+void metrics::render(std::string& out) {
+    auto reg = registry::lock();
+    std::string_view previous;
+    for (auto& [name, m] : reg->metrics) {
+        if (name != previous) {
+            out.append("# HELP ").append(name).append(" ").append(m->help()).append("\n");
+            out.append("# TYPE ").append(name).append(m->kind() == type::counter ? " counter\n" : " gauge\n");
+            previous = name;
+        }
+        out.append(name);
+        if (not m->labels().empty())
+            out.append("{").append(m->labels()).append("}");
+        out.append(" ");
+        append(out, m->value());
+        out.append("\n");
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <string>
+#include <string_view>
+
+/**
+ * Numbers exported on GET /metrics in the Prometheus text format, for a monitoring stack to scrape.
+ * A metric registers itself on construction. Updating it is a single relaxed atomic operation, so it can be done in the
+ * control loop without taking a lock.
+ */
+namespace metrics
+{
+
+enum class type { counter, gauge };
+
+class metric
+{
+public:
+    const std::string& name() const { return m_name; }
+    const std::string& help() const { return m_help; }
+    const std::string& labels() const { return m_labels; }
+    type kind() const { return m_type; }
+    double value() const { return m_value.load(std::memory_order_relaxed); }
+
+protected:
+    // labels as in the exposition format, e.g. connection="sma"
+    metric(type kind, std::string_view name, std::string_view help, std::string_view labels);
+    metric(const metric&) = delete;
+    metric& operator=(const metric&) = delete;
+    ~metric();
+
+    std::atomic<double> m_value = 0.0;
+private:
+    const type m_type;
+    const std::string m_name;
+    const std::string m_help;
+    const std::string m_labels;
+};
+
+/** A value that only goes up, e.g. the number of requests. Its name should end in _total. */
+class counter : public metric
+{
+public:
+    counter(std::string_view name, std::string_view help, std::string_view labels = {})
+    : metric(type::counter, name, help, labels) {}
+
+    void inc(double amount = 1.0) { m_value.fetch_add(amount, std::memory_order_relaxed); }
+};
+
+/** A value that can go up and down, e.g. a measurement. */
+class gauge : public metric
+{
+public:
+    gauge(std::string_view name, std::string_view help, std::string_view labels = {})
+    : metric(type::gauge, name, help, labels) {}
+
+    void set(double value) { m_value.store(value, std::memory_order_relaxed); }
+};
+
+/** Appends all metrics to out in the Prometheus text format (version 0.0.4). */
+void render(std::string& out);
+
+} // namespace metrics
+
+#endif /* METRICS_H_ */
@@ -1,7 +1,10 @@
 #include "modbus.h"
 #include "logf.h"
 #include "config.h"
+#include "metrics.h"
+#include "mutex_protected.h"
 
+#include <map>
 #include <sstream>
 
 #include <sys/socket.h>
@@ -14,20 +17,6 @@ using namespace std::literals::chrono_literals;
 
 namespace modbus {
 namespace error {
-enum type {
-    illegal_function = 1,
-    illegal_data_address = 2,
-    illegal_data_value = 3,
-    slave_device_failure = 4,
-    acknowledge = 5,
-    slave_device_busy = 6,
-    negative_acknowledge = 7,
-    memory_parity_bit_error = 8,
-    gateway_path_unavailable = 10,
-    gateway_target_device_failed_to_respond = 11,
-    invalid_response = 12,
-    unexpected_response = 13,
-};
 
 std::ostream& operator<<(std::ostream& os, type _v) {
     unsigned int v = _v;
@@ -74,9 +63,21 @@ struct request {
     uint8_t unit_id = 0;
     uint8_t function_code = 0;
     uint16_t reference_number;
-    uint16_t word_count;
+    uint16_t word_count; // register value in case of function code 6
 };
 
+struct write_request {
+    uint16_t transaction_id = htons(1);
+    uint16_t protocol_id = 0;
+    uint16_t length;
+    uint8_t unit_id = 0;
+    uint8_t function_code = 16;
+    uint16_t reference_number;
+    uint16_t word_count;
+    uint8_t byte_count;
+    uint8_t payload[246];
+} __attribute__((packed));
+
 struct response {
     uint16_t transaction_id;
     uint16_t protocol_id;
@@ -89,30 +90,85 @@ struct response {
             uint8_t byte_count;
             uint8_t payload[0];
         };
+        struct {
+            uint16_t reference_number;
+            uint16_t word_count; // register value in case of function code 6
+        };
         uint8_t exception;
     };
 
-    void validate(std::size_t received_bytes, const request& req) const {
+    template<typename Request>
+    void validate_header(std::size_t received_bytes, const Request& req) const {
         if (received_bytes < offsetof(response, payload)) throw busexc(error::invalid_response);
         if (transaction_id != req.transaction_id) throw busexc(error::unexpected_response);
         if (protocol_id != 0) throw busexc(error::invalid_response);
         if (status) throw busexc(error::type(exception));
         if (unit_id != req.unit_id) throw busexc(error::unexpected_response);
         if (function_code != req.function_code) throw busexc(error::unexpected_response);
+    }
+
+    void validate(std::size_t received_bytes, const request& req) const {
+        validate_header(received_bytes, req);
         if (byte_count != ntohs(req.word_count) * 2) throw busexc(error::unexpected_response);
         if (ntohs(length) != ntohs(req.word_count) * 2 + 3) throw busexc(error::unexpected_response);
         if (received_bytes != offsetof(response, payload) + byte_count) throw busexc(error::unexpected_response);
     }
+
+    // Write requests are acknowledged by echoing the start address and the value (6) or word count (16).
+    template<typename Request>
+    void validate_echo(std::size_t received_bytes, const Request& req) const {
+        validate_header(received_bytes, req);
+        if (ntohs(length) != 6) throw busexc(error::unexpected_response);
+        if (received_bytes != sizeof(request)) throw busexc(error::unexpected_response);
+        if (reference_number != req.reference_number) throw busexc(error::unexpected_response);
+        if (word_count != req.word_count) throw busexc(error::unexpected_response);
+    }
 };
 
-config::param<int> tcp_connect_timeout("modbus.tcp_receive_timeout", 1000);
-config::param<int> tcp_write_timeout("modbus.tcp_write_timeout", 500);
-config::param<int> tcp_receive_timeout("modbus.tcp_connect_timeout", 500);
+config::param<int> cache_max_age("modbus.cache_max_age", 10000);
+
+struct cache_entry {
+    uint16_t value;
+    std::chrono::steady_clock::time_point updated;
+};
+
+auto lock_cache() {
+    static mutex_protected<std::map<uint32_t, cache_entry>> instance;
+    return instance.lock();
+}
+
+uint32_t cache_key(uint8_t unit_id, uint16_t address) { return uint32_t(unit_id) << 16 | address; }
+
+config::param<int> tcp_connect_timeout("modbus.tcp_receive_timeout", 1000, config::reloadable);
+config::param<int> tcp_write_timeout("modbus.tcp_write_timeout", 500, config::reloadable);
+config::param<int> tcp_receive_timeout("modbus.tcp_connect_timeout", 500, config::reloadable);
 
 } // namespace modbus
 
 using namespace modbus;
 
+void modbus::cache_registers(uint8_t unit_id, const register_vector& values) {
+    auto tnow = std::chrono::steady_clock::now();
+    auto cache = lock_cache();
+    for (uint16_t i = 0; i < values.word_count(); i++) {
+        uint16_t address = values.start_address() + i;
+        (*cache)[cache_key(unit_id, address)] = cache_entry{values.get<uint16_t>(address), tnow};
+    }
+}
+
+std::optional<register_vector> modbus::cached_registers(uint8_t unit_id, uint16_t start_address, uint16_t word_count) {
+    auto tmin = std::chrono::steady_clock::now() - std::chrono::milliseconds{cache_max_age};
+    register_vector result{start_address, word_count};
+    auto cache = lock_cache();
+    auto it = cache->lower_bound(cache_key(unit_id, start_address));
+    for (uint16_t i = 0; i < word_count; i++, it++) {
+        if (it == cache->end() or it->first != cache_key(unit_id, start_address + i) or it->second.updated < tmin)
+            return std::nullopt;
+        result.set<uint16_t>(start_address + i, it->second.value);
+    }
+    return result;
+}
+
 struct connection::impl {
     std::string m_name;
     std::vector<endpoint> m_endpoints;
@@ -120,6 +176,8 @@ struct connection::impl {
     int m_sock = -1;
     boost::system::error_code m_connect_error = syserr(EBADF);
     boost::system::error_code m_request_error{};
+    metrics::counter m_requests{"p1faker_modbus_requests_total", "Modbus requests sent", "connection=\"" + m_name + "\""};
+    metrics::counter m_errors{"p1faker_modbus_errors_total", "Modbus requests that failed or could not be sent for lack of a connection", "connection=\"" + m_name + "\""};
 
     impl(std::string _name)
     : m_name(_name) {}
@@ -213,45 +271,118 @@ struct connection::impl {
         }
     }
 
-    std::optional<register_vector> read_holding_registers(uint8_t unit_id, uint16_t start_address, uint16_t word_count) {
+    bool ensure_connected() {
         if (m_connect_error.failed() or m_request_error.failed())
             reconnect(); // currently in error state -> reconnect.
         if (m_connect_error.failed())
-            return std::nullopt;
+            m_errors.inc();
+        return not m_connect_error.failed();
+    }
 
-        try {
+    // Sends a request and waits for the (not yet validated) response. Returns the number of bytes received.
+    std::size_t transact(const void* req, std::size_t size, std::array<uint8_t, 1500>& raw_response) {
+        m_requests.inc();
+        pollsock(POLLOUT, tcp_write_timeout.get());
+
+        ssize_t written = write(m_sock, req, size);
+        if (written < 0)
+            throw sysexc(errno);
+        else if (std::size_t(written) != size)
+            throw sysexc(EMSGSIZE);
 
-            pollsock(POLLOUT, tcp_write_timeout.get());
+        pollsock(POLLIN, tcp_receive_timeout.get());
 
+        ssize_t received = read(m_sock, &raw_response[0], raw_response.size());
+        if (received < 0)
+            throw sysexc(errno);
+        return received;
+    }
+
+    void request_failed(const char* what, const boost::system::system_error& e) {
+        m_errors.inc();
+        if (m_request_error != e.code()) {
+            logferror("%s %s at %s:%s failed: %s", what, m_name, m_curendpoint.address, m_curendpoint.port,
+                    e.code().message());
+            m_request_error = e.code();
+        }
+    }
+
+    std::optional<register_vector> read_holding_registers(uint8_t unit_id, uint16_t start_address, uint16_t word_count) {
+        if (not ensure_connected())
+            return std::nullopt;
+
+        try {
             request req;
             req.function_code = 3;
             req.reference_number = htons(start_address);
             req.word_count = htons(word_count);
             req.unit_id = unit_id;
-            ssize_t written = write(m_sock, reinterpret_cast<const uint8_t*>(&req), sizeof(req));
-            if (written < 0)
-                throw sysexc(errno);
-            else if (written != sizeof(req))
-                throw sysexc(EMSGSIZE);
-
-            pollsock(POLLIN, tcp_receive_timeout.get());
 
             std::array<uint8_t, 1500> raw_response;
-            std::size_t received = read(m_sock, &raw_response[0], raw_response.size());
+            std::size_t received = transact(&req, sizeof(req), raw_response);
             const response& rep = *reinterpret_cast<const response*>(raw_response.begin());
             rep.validate(received, req);
             m_request_error = {};
-            return register_vector{start_address, &rep.payload[0], rep.byte_count};
+            register_vector result{start_address, &rep.payload[0], rep.byte_count};
+            cache_registers(unit_id, result);
+            return result;
+        } catch (boost::system::system_error& e) {
+            request_failed("Reading modbus registers from", e);
+            return std::nullopt;
+        }
+    }
+
+    bool write_single_register(uint8_t unit_id, uint16_t address, uint16_t value) {
+        if (not ensure_connected())
+            return false;
+
+        try {
+            request req;
+            req.function_code = 6;
+            req.reference_number = htons(address);
+            req.word_count = htons(value);
+            req.unit_id = unit_id;
+
+            std::array<uint8_t, 1500> raw_response;
+            std::size_t received = transact(&req, sizeof(req), raw_response);
+            reinterpret_cast<const response*>(raw_response.begin())->validate_echo(received, req);
+            m_request_error = {};
+            register_vector written{address, 1};
+            written.set<uint16_t>(address, value);
+            cache_registers(unit_id, written);
+            return true;
         } catch (boost::system::system_error& e) {
-             if (m_request_error != e.code()) {
-                 logferror("Reading modbus registers from %s at %s:%s failed: %s",
-                         m_name, m_curendpoint.address, m_curendpoint.port,
-                         e.code().message());
-                 m_request_error = e.code();
-             }
-             return std::nullopt;
+            request_failed("Writing modbus registers to", e);
+            return false;
         }
+    }
+
+    bool write_multiple_registers(uint8_t unit_id, const register_vector& values) {
+        if (not ensure_connected())
+            return false;
+
+        try {
+            write_request req;
+            if (values.word_count() * 2u > sizeof(req.payload))
+                throw sysexc(EMSGSIZE);
+            req.function_code = 16;
+            req.reference_number = htons(values.start_address());
+            req.word_count = htons(values.word_count());
+            req.byte_count = values.word_count() * 2;
+            req.length = htons(offsetof(write_request, payload) - offsetof(write_request, unit_id) + req.byte_count);
+            req.unit_id = unit_id;
+            std::copy(values.data(), values.data() + req.byte_count, &req.payload[0]);
 
+            std::array<uint8_t, 1500> raw_response;
+            std::size_t received = transact(&req, offsetof(write_request, payload) + req.byte_count, raw_response);
+            reinterpret_cast<const response*>(raw_response.begin())->validate_echo(received, req);
+            m_request_error = {};
+            cache_registers(unit_id, values);
+            return true;
+        } catch (boost::system::system_error& e) {
+            request_failed("Writing modbus registers to", e);
+            return false;
+        }
     }
 
 };
@@ -268,3 +399,10 @@ std::optional<register_vector> connection::read_holding_registers(uint8_t unit_i
     return m_impl->read_holding_registers(unit_id, start_address, word_count);
 }
 
+bool connection::write_single_register(uint8_t unit_id, uint16_t address, uint16_t value) {
+    return m_impl->write_single_register(unit_id, address, value);
+}
+
+bool connection::write_multiple_registers(uint8_t unit_id, const register_vector& values) {
+    return m_impl->write_multiple_registers(unit_id, values);
+}
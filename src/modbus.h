@@ -4,10 +4,29 @@
 #include <vector>
 #include <optional>
 #include <memory>
+#include <type_traits>
 #include <boost/asio/ip/address.hpp>
 
 namespace modbus {
 
+namespace error {
+enum type {
+    illegal_function = 1,
+    illegal_data_address = 2,
+    illegal_data_value = 3,
+    slave_device_failure = 4,
+    acknowledge = 5,
+    slave_device_busy = 6,
+    negative_acknowledge = 7,
+    memory_parity_bit_error = 8,
+    gateway_path_unavailable = 10,
+    gateway_target_device_failed_to_respond = 11,
+    invalid_response = 12,
+    unexpected_response = 13,
+};
+std::ostream& operator<<(std::ostream& os, type v);
+}
+
 struct endpoint {
     boost::asio::ip::address address;
     uint16_t port;
@@ -24,14 +43,37 @@ struct register_vector {
         return ret;
     }
 
+    template<typename T>
+    void set(uint16_t address, T value) {
+        auto v = static_cast<std::make_unsigned_t<T>>(value);
+        for (std::size_t i = sizeof(T); i-- > 0; v >>= 8)
+            m_data[(address - m_start_address) * 2 + i] = v & 0xff;
+    }
+
+    uint16_t start_address() const { return m_start_address; }
+    uint16_t word_count() const { return m_data.size() / 2; }
+    const uint8_t* data() const { return m_data.data(); }
+
     register_vector(uint16_t start_address, const uint8_t* data, std::size_t size)
     : m_start_address(start_address), m_data{data, data + size} {}
 
+    /** Zero-initialized registers, to be filled in with set() before writing them. */
+    register_vector(uint16_t start_address, uint16_t word_count)
+    : m_start_address(start_address), m_data(word_count * 2) {}
+
 private:
     uint16_t m_start_address;
     std::vector<uint8_t> m_data;
 };
 
+/**
+ * Every register successfully read or written by any connection is remembered per unit id,
+ * so that the latest values can be served to others without touching the device again.
+ * Registers that were not refreshed during the last modbus.cache_max_age milliseconds are considered unavailable.
+ */
+void cache_registers(uint8_t unit_id, const register_vector& values);
+std::optional<register_vector> cached_registers(uint8_t unit_id, uint16_t start_address, uint16_t word_count);
+
 class connection {
 public:
     connection(std::string name);
@@ -39,6 +81,8 @@ public:
     void update_endpoint_candidates(const std::vector<endpoint>& endpoints);
 
     std::optional<register_vector> read_holding_registers(uint8_t unit_id, uint16_t start_address, uint16_t word_count);
+    bool write_single_register(uint8_t unit_id, uint16_t address, uint16_t value);
+    bool write_multiple_registers(uint8_t unit_id, const register_vector& values);
 private:
     struct impl;
     std::shared_ptr<impl> m_impl;
@@ -0,0 +1,214 @@
+#include "core.h"
+#include "config.h"
+#include "logf.h"
+#include "modbus.h"
+#include "settings.h"
+
+#include <boost/beast/core.hpp>
+#include <boost/asio/dispatch.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/write.hpp>
+
+#include <array>
+#include <optional>
+#include <thread>
+
+namespace beast = boost::beast;
+namespace asio = boost::asio;
+using tcp = asio::ip::tcp;
+
+using namespace std::literals::chrono_literals;
+
+namespace
+{
+
+struct ip_parser {
+    asio::ip::address operator()(std::string_view text) { return asio::ip::make_address(text); }
+};
+
+config::param<bool> enable{"modbus_server.enable", false};
+config::param<asio::ip::address, ip_parser> bind_address{"modbus_server.bind_address", asio::ip::address{}};
+config::param<uint16_t> bind_port{"modbus_server.bind_port", 502};
+config::param<int> virtual_unit_id{"modbus_server.unit_id", 100};
+
+// Registers published on the virtual unit, 32 bits each (high word first), in the same style as the SMA registers.
+enum virtual_register
+{
+    budget_current = 0, // S32, mA per phase
+    budget_power = 2, // S32, W
+    budget_battery_output = 4, // S32, W, 0x80000000 if not set
+    active_policy = 6, // U32, policy index
+    virtual_register_end = 8
+};
+
+void fail(beast::error_code ec, char const* what) {
+    logferror("modbus server %s: %s", what, ec.message());
+}
+
+// Serves one Modbus TCP client. Only "read holding registers" is supported and it is answered from the register cache.
+struct session : public std::enable_shared_from_this<session> {
+    static constexpr std::size_t header_size = 7; // MBAP header, up to and including unit id
+
+    session(tcp::socket&& socket) : m_stream(std::move(socket)) {}
+
+    void run() {
+        asio::dispatch(m_stream.get_executor(),
+                beast::bind_front_handler(&session::do_read_header, shared_from_this()));
+    }
+
+    void do_read_header() {
+        m_stream.expires_after(300s);
+        asio::async_read(m_stream, asio::buffer(m_request.data(), header_size),
+                beast::bind_front_handler(&session::on_read_header, shared_from_this()));
+    }
+
+    void on_read_header(beast::error_code ec, std::size_t) {
+        if (ec == asio::error::eof)
+            return do_close();
+        if (ec)
+            return fail(ec, "read");
+
+        std::size_t length = m_request[4] << 8 | m_request[5];
+        if (m_request[2] != 0 or m_request[3] != 0 or length < 2 or header_size + length - 1 > m_request.size()) {
+            logfwarn("modbus server: dropping client that sent an invalid header");
+            return do_close();
+        }
+        asio::async_read(m_stream, asio::buffer(&m_request[header_size], length - 1),
+                beast::bind_front_handler(&session::on_read_pdu, shared_from_this()));
+    }
+
+    void on_read_pdu(beast::error_code ec, std::size_t size) {
+        if (ec)
+            return fail(ec, "read");
+
+        handle_pdu(size);
+
+        asio::async_write(m_stream, asio::buffer(m_response),
+                beast::bind_front_handler(&session::on_write, shared_from_this()));
+    }
+
+    void handle_pdu(std::size_t size) {
+        uint8_t unit_id = m_request[6];
+        uint8_t function_code = m_request[7];
+        // transaction id, protocol id and unit id are echoed, length is filled in at the end
+        m_response.assign(m_request.begin(), m_request.begin() + header_size);
+        auto reply_exception = [&] (modbus::error::type e) {
+            m_response.push_back(function_code | 0x80);
+            m_response.push_back(e);
+        };
+
+        if (function_code != 3) {
+            reply_exception(modbus::error::illegal_function);
+        } else if (size != 5) {
+            reply_exception(modbus::error::illegal_data_value);
+        } else {
+            uint16_t start_address = m_request[8] << 8 | m_request[9];
+            uint16_t word_count = m_request[10] << 8 | m_request[11];
+            if (word_count < 1 or word_count > 125) {
+                reply_exception(modbus::error::illegal_data_value);
+            } else if (auto reg = modbus::cached_registers(unit_id, start_address, word_count)) {
+                m_response.push_back(function_code);
+                m_response.push_back(word_count * 2);
+                m_response.insert(m_response.end(), reg->data(), reg->data() + word_count * 2);
+            } else {
+                reply_exception(modbus::error::gateway_target_device_failed_to_respond);
+            }
+        }
+
+        std::size_t length = m_response.size() - header_size + 1;
+        m_response[4] = length >> 8;
+        m_response[5] = length & 0xff;
+    }
+
+    void on_write(beast::error_code ec, std::size_t) {
+        if (ec)
+            return fail(ec, "write");
+
+        // next please
+        do_read_header();
+    }
+
+    void do_close() {
+        beast::error_code ec;
+        m_stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+    }
+
+private:
+    beast::tcp_stream m_stream;
+    std::array<uint8_t, 260> m_request;
+    std::vector<uint8_t> m_response;
+};
+
+// Accepts incoming connections and launches the sessions
+struct listener : public std::enable_shared_from_this<listener> {
+    listener(asio::io_context& ioc, tcp::endpoint endpoint)
+    : m_ioc(ioc), m_acceptor(asio::make_strand(m_ioc)) {
+        m_acceptor.open(endpoint.protocol());
+        m_acceptor.set_option(asio::socket_base::reuse_address(true));
+        m_acceptor.bind(endpoint);
+        m_acceptor.listen(asio::socket_base::max_listen_connections);
+    }
+
+    void run() {
+        do_accept();
+    }
+
+private:
+    void do_accept() {
+        // The new session gets its own strand
+        m_acceptor.async_accept(asio::make_strand(m_ioc),
+            beast::bind_front_handler(&listener::on_accept, shared_from_this()));
+    }
+
+    void on_accept(beast::error_code ec, tcp::socket socket) {
+        if (ec)
+            return fail(ec, "accept");
+
+        std::make_shared<session>(std::move(socket))->run();
+
+        // Accept another connection
+        do_accept();
+    }
+
+    asio::io_context& m_ioc;
+    tcp::acceptor m_acceptor;
+};
+
+struct server : core::consumer {
+    server() : core::consumer("modbus_server") {
+        try {
+            std::make_shared<listener>(m_ioc, tcp::endpoint{bind_address, bind_port})->run();
+            m_thread = std::thread{[&] { m_ioc.run(); }};
+            logfinfo("Serving cached modbus registers on port %d, virtual registers on unit id %d", bind_port, virtual_unit_id);
+        } catch (boost::system::system_error& e) {
+            logferror("Failed to set up modbus server: %s", e.what());
+        }
+    }
+
+    ~server() {
+        m_ioc.stop();
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+
+    void handle(const core::budget& b, const core::situation& sit) override {
+        modbus::register_vector reg{0, virtual_register_end};
+        reg.set<int32_t>(budget_current, std::lround(b.current * 1000.0));
+        reg.set<int32_t>(budget_power, std::lround(b.current * sit.grid_voltage() * sit.grid.size()));
+        reg.set<int32_t>(budget_battery_output, b.battery_output ? int32_t(std::lround(*b.battery_output)) : INT32_MIN);
+        reg.set<uint32_t>(active_policy, m_active_policy.get());
+        modbus::cache_registers(virtual_unit_id, reg);
+    }
+
+    settings::param<int> m_active_policy{"active_policy", 0};
+    asio::io_context m_ioc;
+    std::thread m_thread;
+};
+
+std::optional<server> impl;
+int _ = core::at_startup([] {
+    if (enable) impl.emplace();
+});
+
+} // anonymous namespace
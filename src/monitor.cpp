@@ -1,8 +1,14 @@
 #include "core.h"
 #include "logf.h"
+#include "metrics.h"
 #include "mutex_protected.h"
 #include "www.h"
 
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <vector>
+
 namespace
 {
 
@@ -23,13 +29,61 @@ struct monitor : core::consumer
         return int(s->budget.current * s->situation.grid_voltage() * s->situation.grid.size());
     });
 
+    metrics::gauge m_battery_state{"p1faker_battery_state", "State of charge of the battery, from 0 to 1"};
+    metrics::gauge m_inverter_output{"p1faker_inverter_output_watts", "Output of the inverter, solar and battery together"};
+    metrics::gauge m_battery_output{"p1faker_battery_output_watts", "Discharge power of the battery, negative when charging"};
+    metrics::gauge m_solar_output{"p1faker_solar_output_watts", "Output of the solar panels"};
+    metrics::gauge m_grid_output{"p1faker_grid_output_watts", "Power taken from the grid, negative when feeding in"};
+    metrics::gauge m_consumption{"p1faker_consumption_watts", "Consumption of the house"};
+    metrics::gauge m_budget_current{"p1faker_budget_current_amperes", "Current per phase that the charge point may take on top of what it takes now"};
+    metrics::gauge m_budget_battery_output{"p1faker_budget_battery_output_watts", "Setpoint for the battery, NaN if it follows its own control loop"};
+    metrics::gauge m_budget_limit{"p1faker_budget_limit_amperes", "Upper bound for the budget current"};
+    struct phase_metrics
+    {
+        metrics::gauge voltage;
+        metrics::gauge current;
+    };
+    std::vector<std::unique_ptr<phase_metrics>> m_phases; // created with the first situation, which tells how many phases there are
+
     monitor() : core::consumer("monitor") {}
 
+    void update_metrics(const core::budget& b, const core::situation& sit)
+    {
+        m_battery_state.set(sit.battery_state);
+        m_inverter_output.set(sit.inverter_output);
+        m_battery_output.set(sit.battery_output);
+        m_solar_output.set(sit.solar_output());
+        m_grid_output.set(sit.grid_output());
+        m_consumption.set(sit.consumption());
+        m_budget_current.set(b.current);
+        m_budget_battery_output.set(b.battery_output.value_or(std::numeric_limits<double>::quiet_NaN()));
+        m_budget_limit.set(b.limit);
+        while (m_phases.size() < sit.grid.size()) {
+            auto label = "phase=\"" + std::to_string(m_phases.size() + 1) + "\"";
+            m_phases.emplace_back(new phase_metrics{
+                    {"p1faker_grid_voltage_volts", "Voltage of a phase of the grid connection", label},
+                    {"p1faker_grid_current_amperes", "Current taken from the grid on a phase, negative when feeding in", label}});
+        }
+        for (std::size_t i = 0; i < sit.grid.size(); i++) {
+            m_phases[i]->voltage.set(sit.grid[i].voltage);
+            m_phases[i]->current.set(sit.grid[i].current);
+        }
+    }
+
     void handle(const core::budget& b, const core::situation& sit) override
     {
+        update_metrics(b, sit);
+
         auto s = m_state.lock();
         s->budget = b;
         s->situation = sit;
+
+        nlohmann::json event = *s;
+        event["curcap"] = int(b.current * sit.grid_voltage() * sit.grid.size());
+        // lets clients measure the jitter of the tick loop
+        event["time"] = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+        www::publish("monitor", event);
     }
 } impl;
 
@@ -37,7 +91,8 @@ void to_json(nlohmann::json& j, const monitor::state& s)
 {
     j = nlohmann::json{
         {"budget", nlohmann::json{
-            {"current", s.budget.current}
+            {"current", s.budget.current},
+            {"battery_output", s.budget.battery_output ? nlohmann::json(*s.budget.battery_output) : nlohmann::json()}
         }},
         {"situation", nlohmann::json{
             {"battery_state", s.situation.battery_state},
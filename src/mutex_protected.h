@@ -2,6 +2,7 @@
 #define MUTEX_PROTECTED_H_
 
 #include <mutex>
+#include <shared_mutex>
 
 template<typename T, typename Lockable = std::mutex>
 class mutex_protected
@@ -25,6 +26,9 @@ public:
     auto lock()      & { return locked_access<      T>{&m_value, m_mtx}; }
     auto lock() const& { return locked_access<const T>{&m_value, m_mtx}; }
 
+    // read-only access that can be shared with other readers, if Lockable is a shared mutex
+    auto lock_shared() const& { return locked_access<const T, std::shared_lock<Lockable>>{&m_value, m_mtx}; }
+
 private:
     T m_value;
     mutable Lockable m_mtx;
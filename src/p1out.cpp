@@ -1,10 +1,16 @@
 #include "core.h"
 #include "config.h"
 #include "logf.h"
+#include "metrics.h"
 #include "www.h"
 #include "mutex_protected.h"
 
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <atomic>
 #include <fstream>
+#include <thread>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -18,6 +24,8 @@
 namespace
 {
 
+config::param<int> interval{"interval", 1000, config::reloadable};
+
 const char* p1template = "/XMX5XMXCQA0000020863\r\n"
     "\r\n"
     "1-3:0.2.8(40)\r\n"
@@ -75,7 +83,13 @@ uint16_t crc16(std::string_view payload)
 struct consumer_impl : core::consumer
 {
     consumer_impl() : core::consumer("p1out") {}
-    ~consumer_impl() { reset(); }
+    ~consumer_impl()
+    {
+        m_status_ioc.stop();
+        if (m_status_thread.joinable())
+            m_status_thread.join();
+        reset();
+    }
 
     void reset()
     {
@@ -94,7 +108,7 @@ struct consumer_impl : core::consumer
         m_fd = m_filename.get().empty() ? STDOUT_FILENO : open(m_filename.get().c_str(), O_RDWR | O_SYNC | O_EXCL);
         if (m_fd < 0) {
             if (m_connect_errno != errno)
-                logferror("Could not open %s: %s. Using stdout instead.\n", m_filename, strerror(errno));
+                logferror("Could not open %s: %s. Using stdout instead.", m_filename, strerror(errno));
             m_connect_errno = errno;
             m_fd = STDOUT_FILENO;
             return;
@@ -132,6 +146,8 @@ struct consumer_impl : core::consumer
         int err = n == ssize_t(fullmsg.size()) ? 0
                 : n < 0 ? errno
                 : EMSGSIZE; // don't support partial writes, so treat it as an error (Message too long).
+        if (err)
+            m_write_errors.inc();
         if (err != m_write_errno) {
             if (err) logferror("Writing %u bytes to p1 output failed: %s", fullmsg.size(), strerror(errno));
             else logfinfo("Successfully written %u bytes to p1 output", fullmsg.size());
@@ -146,22 +162,52 @@ struct consumer_impl : core::consumer
     int m_fd = STDOUT_FILENO;
     int m_connect_errno = EBADFD;
     int m_write_errno = 0;
+    metrics::counter m_write_errors{"p1faker_p1out_write_errors_total", "Telegrams that could not be written to the p1 output"};
     mutex_protected<std::string> m_p1cache;
 
-    www::rpc m_status_rpc = www::rpc::get("p1status", [] {
-        static config::param<std::string> path{"p1status.path", "/sys/class/gpio/gpio2/value"};
-        static bool was_open = true;
-        std::ifstream fin{path.get()};
-        if (fin.is_open() != was_open) {
-            if (fin.is_open()) logfdebug("Successfully opened %s for reading", path);
-            else logferror("Could not open %s for reading", path);
-            was_open = fin.is_open();
+    // whether the charge point is connected
+    bool status() {
+        std::ifstream fin{m_status_path.get()};
+        if (fin.is_open() != m_status_was_open.exchange(fin.is_open())) {
+            if (fin.is_open()) logfdebug("Successfully opened %s for reading", m_status_path);
+            else logferror("Could not open %s for reading", m_status_path);
         }
         if (not fin.is_open()) return false;
         bool result;
         fin >> result;
         result = !result; // inverted due to opto coupler
         return result;
+    }
+
+    config::param<std::string> m_status_path{"p1status.path", "/sys/class/gpio/gpio2/value"};
+    std::atomic<bool> m_status_was_open = true;
+
+    // Publishes the status every interval from a thread of its own: reading the GPIO goes through sysfs, which is
+    // too slow for the tick.
+    void watch_status()
+    {
+        www::publish("p1status", status());
+        m_status_timer.expires_after(std::chrono::milliseconds{interval.get()});
+        m_status_timer.async_wait([this](boost::system::error_code ec) {
+            if (not ec)
+                watch_status();
+        });
+    }
+
+    void start()
+    {
+        m_status_thread = std::thread{[this] {
+            watch_status();
+            m_status_ioc.run();
+        }};
+    }
+
+    boost::asio::io_context m_status_ioc;
+    boost::asio::steady_timer m_status_timer{m_status_ioc};
+    std::thread m_status_thread;
+
+    www::rpc m_status_rpc = www::rpc::get("p1status", [this] {
+        return status();
     });
 
     www::rpc m_out_rpc = www::rpc::get("p1out", [this] {
@@ -169,4 +215,6 @@ struct consumer_impl : core::consumer
     });
 } impl;
 
+int _ = core::at_startup([] { impl.start(); });
+
 } // anonymous namespace
@@ -0,0 +1,335 @@
+#include "core.h"
+#include "config.h"
+#include "settings.h"
+#include "logf.h"
+#include "mutex_protected.h"
+#include "www.h"
+
+#include <boost/algorithm/string/trim.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <optional>
+#include <vector>
+
+#include <sys/stat.h>
+#include <time.h>
+
+using namespace std::literals::chrono_literals;
+
+namespace
+{
+
+using clock_type = std::chrono::system_clock;
+using quarter_hours = std::chrono::duration<int64_t, std::ratio<900>>;
+
+config::param<std::string> forecast_file{"planner.forecast_file", "forecast.csv"}; // solar power forecast in W
+config::param<std::string> tariff_file{"planner.tariff_file", "tariff.csv"}; // energy price per kWh
+settings::param<double> target_energy{"planner.target_energy", 0.0}; // kWh to charge before departure
+settings::param<int> departure{"planner.departure", 0}; // seconds since epoch
+settings::param<double> house_power{"planner.house_power", 500.0}; // W consumed by the household itself
+settings::param<double> replan_threshold{"planner.replan_threshold", 500.0}; // W difference between measured and forecasted solar power
+settings::param<double> car_min_power{"car_min_power", 5500.0};
+settings::param<double> car_max_power{"car_max_power", 11000.0};
+
+std::optional<time_t> parse_time(const std::string& text) {
+    if (not text.empty() and text.find_first_not_of("0123456789") == std::string::npos)
+        return std::stoll(text);
+    for (const char* format : {"%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M", "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M"}) {
+        struct tm tm = {};
+        const char* end = strptime(text.c_str(), format, &tm);
+        if (end and *end == '\0') {
+            tm.tm_isdst = -1;
+            return mktime(&tm);
+        }
+    }
+    return std::nullopt;
+}
+
+// Values that hold from their time stamp until the next one, read from a CSV file with lines "time,value"
+// or a JSON file with an array of {"time": ..., "value": ...} objects or [time, value] pairs.
+// Times are seconds since epoch or local ISO 8601 date-times.
+struct series {
+    std::map<time_t, double> values;
+    time_t mtime = 0;
+
+    std::optional<double> at(time_t t) const {
+        auto it = values.upper_bound(t);
+        if (it == values.begin())
+            return std::nullopt;
+        return std::prev(it)->second;
+    }
+
+    // returns whether the file changed since it was last loaded
+    bool reload(const std::string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            if (mtime != 0)
+                logfwarn("Planner input %s disappeared", path);
+            bool changed = mtime != 0;
+            mtime = 0;
+            values.clear();
+            return changed;
+        }
+        if (st.st_mtime == mtime)
+            return false;
+        mtime = st.st_mtime;
+        values.clear();
+
+        std::ifstream fin{path};
+        try {
+            if (path.ends_with(".json")) {
+                for (const auto& entry : nlohmann::json::parse(fin)) {
+                    const auto& t = entry.is_array() ? entry.at(0) : entry.at("time");
+                    const auto& v = entry.is_array() ? entry.at(1) : entry.at("value");
+                    auto time = t.is_number() ? std::optional<time_t>{t.get<time_t>()} : parse_time(t.get<std::string>());
+                    if (not time)
+                        throw std::runtime_error{"invalid time " + t.dump()};
+                    values[*time] = v.get<double>();
+                }
+            } else {
+                std::string line;
+                while (std::getline(fin, line)) {
+                    line.resize(std::min(line.find('#'), line.size()));
+                    auto pos = line.find_first_of(",;");
+                    if (pos == std::string::npos)
+                        continue;
+                    std::string t = line.substr(0, pos);
+                    std::string v = line.substr(pos + 1);
+                    boost::trim(t);
+                    boost::trim(v);
+                    auto time = parse_time(t);
+                    if (not time)
+                        continue; // e.g. a header line
+                    values[*time] = std::stod(v);
+                }
+            }
+            logfinfo("Loaded %d entries from planner input %s", values.size(), path);
+        } catch (std::exception& e) {
+            logferror("Failed to load planner input %s: %s", path, e.what());
+            values.clear();
+        }
+        return true;
+    }
+};
+
+struct quarter_plan {
+    time_t start;
+    double duration; // s, the first and last quarter may be partial
+    double price;
+    double solar; // W, forecast corrected with the latest measurement
+    double car_power; // W
+    double grid_power; // W, part of car_power that is imported from the grid
+};
+
+// Plans the cheapest way to charge the target energy before departure: solar surplus is free, the rest is
+// bought in the quarters with the lowest price. Above the minimum power of the charge point, each quarter's cost
+// is linear in the power it gets, so filling the cheapest quarters first is optimal. The minimum power makes it
+// a step, though: a quarter that only needs a little more energy has to buy the minimum for the whole quarter.
+// So the last quarter, which may need less than the minimum, is the one where finishing costs least, not
+// necessarily the cheapest one left. This takes a few microseconds, so the plan is simply recomputed for the
+// remaining quarters whenever its inputs change.
+std::vector<quarter_plan> solve(time_t tnow, time_t tdeparture, double energy, const series& forecast, const series& tariff,
+        double solar_correction) {
+    std::vector<quarter_plan> plan;
+    auto pmax = car_max_power.get();
+    auto pmin = car_min_power.get();
+    auto quarter = std::chrono::duration_cast<std::chrono::seconds>(quarter_hours{1}).count();
+    for (time_t t = tnow; t < tdeparture; t = (t / quarter + 1) * quarter) {
+        auto end = std::min(tdeparture, (t / quarter + 1) * quarter);
+        // the measured deviation from the forecast fades out over the next hour
+        double correction = solar_correction * std::exp(-double(t - tnow) / 3600.0);
+        plan.push_back(quarter_plan{t, double(end - t), tariff.at(t).value_or(0.0),
+            std::max(0.0, forecast.at(t).value_or(0.0) + correction), 0.0, 0.0});
+    }
+
+    auto energy_of = [](double power, const quarter_plan& q) { return power * q.duration / 3600.0 * 0.001; }; // kWh
+    auto power_for = [](double energy, const quarter_plan& q) { return energy * 1000.0 * 3600.0 / q.duration; }; // W
+    auto surplus = [&](const quarter_plan& q) { return std::min(pmax, std::max(0.0, q.solar - house_power.get())); };
+
+    // free segments first, as far as the surplus is enough for the charge point to start
+    for (auto& q : plan) {
+        if (energy <= 0.0) break;
+        if (surplus(q) < pmin) continue;
+        q.car_power = std::min(surplus(q), power_for(energy, q));
+        energy -= energy_of(q.car_power, q);
+    }
+
+    // then grid segments, cheapest first, which also make a surplus below the minimum usable
+    std::vector<quarter_plan*> by_price;
+    for (auto& q : plan)
+        by_price.push_back(&q);
+    std::stable_sort(by_price.begin(), by_price.end(), [](auto l, auto r) { return l->price < r->price; });
+    // what a quarter has to buy for the energy, or for as much of it as fits, if it finishes the energy
+    auto buy = [&](const quarter_plan& q, double energy) {
+        auto free = std::max(q.car_power, surplus(q));
+        auto power = std::clamp(power_for(energy, q) - (free - q.car_power), 0.0, pmax - free);
+        // the charge point does not charge below its minimum power, so rather buy a bit more
+        if (free + power < pmin)
+            power = std::max(0.0, std::min(pmax, pmin) - free);
+        return power;
+    };
+    auto fill = [&](quarter_plan& q, double power) {
+        auto free = std::max(q.car_power, surplus(q));
+        energy -= energy_of(free - q.car_power + power, q);
+        q.car_power = free + power;
+        q.grid_power = power;
+    };
+    for (auto it = by_price.begin(); it != by_price.end() and energy > 0.0; ++it) {
+        auto free = std::max((*it)->car_power, surplus(**it));
+        if (power_for(energy, **it) - (free - (*it)->car_power) >= pmin - free) {
+            fill(**it, buy(**it, energy));
+            continue;
+        }
+        // the rest fits below the minimum power here, so finish it in whichever quarter left does that for least
+        auto cost = [&](const quarter_plan* q) {
+            auto power = buy(*q, energy);
+            auto added_free = std::max(q->car_power, surplus(*q)) - q->car_power;
+            if (energy_of(added_free + power, *q) < energy * (1.0 - 1e-9))
+                return std::numeric_limits<double>::infinity(); // too short, or too little room left
+            return q->price * energy_of(power, *q);
+        };
+        auto best = std::min_element(it, by_price.end(), [&](auto l, auto r) { return cost(l) < cost(r); });
+        fill(**best, buy(**best, energy));
+        break;
+    }
+    return plan;
+}
+
+struct planner : core::consumer
+{
+    struct state {
+        series forecast;
+        series tariff;
+        std::vector<quarter_plan> plan;
+        double delivered = 0.0; // kWh charged since the target was set
+        double target = 0.0;
+        time_t departure = 0;
+        double solar_correction = 0.0;
+        int64_t quarter = 0;
+        clock_type::time_point last_sample;
+    };
+    mutex_protected<state> m_state;
+
+    planner() : core::consumer("planner") {}
+
+    void handle(const core::budget&, const core::situation& sit) override
+    {
+        auto tnow = clock_type::now();
+        auto t = clock_type::to_time_t(tnow);
+        auto s = m_state.lock();
+
+        bool replan = false;
+        replan |= s->forecast.reload(forecast_file);
+        replan |= s->tariff.reload(tariff_file);
+
+        if (s->target != target_energy.get() or s->departure != departure.get()) {
+            s->target = target_energy.get();
+            s->departure = departure.get();
+            s->delivered = 0.0;
+            replan = true;
+        }
+
+        // the car's power is not measured directly, so estimate it from what the household does not explain. The
+        // charge point never draws less than its minimum power, so less than that is the household varying.
+        if (s->last_sample != clock_type::time_point{}) {
+            auto car_power = std::max(0.0, sit.consumption() - house_power.get());
+            if (car_power < car_min_power.get())
+                car_power = 0.0;
+            s->delivered += car_power * std::chrono::duration<double>(tnow - s->last_sample).count() / 3600.0 * 0.001;
+        }
+        s->last_sample = tnow;
+
+        auto quarter = std::chrono::floor<quarter_hours>(tnow).time_since_epoch().count();
+        if (quarter != s->quarter) {
+            s->quarter = quarter;
+            replan = true;
+        }
+
+        if (auto forecast = s->forecast.at(t)) {
+            auto correction = sit.solar_output() - *forecast;
+            if (std::abs(correction - s->solar_correction) > replan_threshold.get()) {
+                s->solar_correction = correction;
+                replan = true;
+            }
+        }
+
+        if (replan) {
+            auto t0 = std::chrono::steady_clock::now();
+            s->plan = solve(t, s->departure, s->target - s->delivered, s->forecast, s->tariff, s->solar_correction);
+            auto t1 = std::chrono::steady_clock::now();
+            logfdebug("Planned %d quarters for %.1f kWh in %d us", s->plan.size(), s->target - s->delivered,
+                    std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count());
+        }
+    }
+
+    std::optional<quarter_plan> current() const
+    {
+        auto t = clock_type::to_time_t(clock_type::now());
+        auto s = m_state.lock();
+        for (const auto& q : s->plan)
+            if (t >= q.start and t < q.start + q.duration)
+                return q;
+        return std::nullopt;
+    }
+
+    www::rpc m_rpc = www::rpc::get("planner", [this] {
+        auto s = m_state.lock();
+        nlohmann::json quarters = nlohmann::json::array();
+        double cost = 0.0;
+        for (const auto& q : s->plan) {
+            quarters.push_back({
+                {"start", q.start},
+                {"price", q.price},
+                {"solar", q.solar},
+                {"car_power", q.car_power},
+                {"grid_power", q.grid_power}
+            });
+            cost += q.grid_power * q.duration / 3600.0 * 0.001 * q.price;
+        }
+        return nlohmann::json{
+            {"target", s->target},
+            {"delivered", s->delivered},
+            {"departure", s->departure},
+            {"cost", cost},
+            {"quarters", quarters}
+        };
+    });
+} planner_impl;
+
+struct planned_impl : core::policy
+{
+    planned_impl() : core::policy{"planned"} {}
+
+    virtual std::string_view icon() const { return "wi-time-8"; }
+    virtual std::string_view label() const { return "Gepland laden"; }
+    virtual std::string_view description() const {
+        return "<p>Laad de gevraagde energie tegen het vertrek aan de laagste kost, volgens de voorspelde "
+               "zonne-energie en de dynamische energieprijzen.</p>"
+               "<p>Zonne-energie die het huishouden niet zelf verbruikt, wordt altijd gebruikt. Wat nog "
+               "ontbreekt, wordt afgenomen in de goedkoopste kwartieren.</p>";
+    }
+
+    // Allow the grid import the plan foresees for this quarter; any solar surplus comes on top of that.
+    core::budget apply(const core::situation& sit)
+    {
+        auto q = planner_impl.current();
+        auto power_budget = (q ? q->grid_power : 0.0) - sit.grid_output();
+        auto current_budget = power_budget / sit.grid_voltage() / sit.grid.size();
+
+        // never exceed what the main fuse can take, as in the red policy
+        auto maxphase = std::max_element(sit.grid.begin(), sit.grid.end(),
+                [](const auto& l, const auto& r) { return l.current < r.current; });
+        auto current_budget_fuse = m_max_current.get() - maxphase->current;
+
+        return core::budget{std::min(current_budget, current_budget_fuse), std::nullopt, current_budget_fuse};
+    }
+
+    settings::param<double> m_max_current{"max_current", 0.0};
+} planned;
+
+} // anonymous namespace
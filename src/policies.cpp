@@ -2,6 +2,8 @@
 #include "settings.h"
 #include "logf.h"
 
+#include <limits>
+
 namespace
 {
 
@@ -24,7 +26,8 @@ struct red_impl : core::policy
     {
         auto maxphase = std::max_element(sit.grid.begin(), sit.grid.end(),
                 [](const auto& l, const auto& r) { return l.current < r.current; });
-        return {m_max_current.get() - maxphase->current};
+        auto current_budget = m_max_current.get() - maxphase->current;
+        return {current_budget, std::nullopt, current_budget};
     }
 
     settings::param<double> m_max_current{"max_current", 0.0};
@@ -33,6 +36,9 @@ struct red_impl : core::policy
 settings::param<double> battery_max_power("battery_max_power", 5000.0);
 settings::param<double> battery_min_state("battery_min_state", 10.0);
 settings::param<double> inverter_max_power("inverter_max_power", 8000.0);
+settings::param<double> battery_hold_state("battery_hold_state", 0.0); // 0 disables coordinated battery dispatch
+constexpr double battery_hold_hysteresis = 5.0; // % the battery may drop below battery_hold_state before it is released
+constexpr double battery_hold_release_power = 500.0; // W imported beyond max_grid_power before the battery is released
 
 struct gen_impl : core::policy
 {
@@ -42,17 +48,57 @@ struct gen_impl : core::policy
     , m_min_solar_power{str(boost::format("%s.min_solar_power") % name), min_solar_power}
     {}
 
-    core::budget apply(const core::situation& sit)
+    // the settings this policy depends on, read again only when settings have changed
+    struct limits
     {
-        auto power_budget = m_max_grid_power.get();
+        double max_grid_power;
+        double min_solar_power;
+        double battery_hold_state;
+        double battery_min_state;
+        double battery_max_power;
+        double inverter_max_power;
+    };
+
+    const limits& get_limits()
+    {
+        auto version = settings::version();
+        if (version != m_version) {
+            m_limits = settings::read([&] {
+                return limits{m_max_grid_power, m_min_solar_power, battery_hold_state, battery_min_state,
+                        battery_max_power, inverter_max_power};
+            });
+            m_version = version;
+        }
+        return m_limits;
+    }
 
-        if (sit.solar_output() >= m_min_solar_power.get()) {
+    core::budget apply(const core::situation& sit)
+    {
+        auto& l = get_limits();
+        auto power_budget = l.max_grid_power;
+
+        // battery nearly full while the sun would charge it further: keep it idle, so that the solar surplus goes to the
+        // car instead of topping up the battery. Without solar surplus the battery is released again to supply the house,
+        // or a hold at night would keep it full, and idle, forever.
+        auto surplus = sit.solar_output() - sit.consumption(); // what charges the battery or is exported, if positive
+        bool sunny = sit.solar_output() > 0.0 and sit.solar_output() >= l.min_solar_power;
+        if (l.battery_hold_state <= 0.0 or not sunny
+                or sit.battery_state < (l.battery_hold_state - battery_hold_hysteresis) * 0.01
+                or surplus < -(l.max_grid_power + battery_hold_release_power))
+            m_hold_battery = false;
+        else if (surplus > 0.0 and sit.battery_state >= l.battery_hold_state * 0.01)
+            m_hold_battery = true;
+        bool hold_battery = m_hold_battery;
+
+        if (sit.solar_output() >= l.min_solar_power) {
             auto inverter_power_budget = sit.solar_output();
-            if (sit.battery_state >= battery_min_state.get() * 0.01)
-                inverter_power_budget += battery_max_power.get();
+            if (hold_battery)
+                ; // battery neither charges nor discharges
+            else if (sit.battery_state >= l.battery_min_state * 0.01)
+                inverter_power_budget += l.battery_max_power;
             else if (sit.battery_output > 0.0) // under 5%, battery may keep on giving whatever it is giving, but not more
                 inverter_power_budget += sit.battery_output;
-            power_budget += std::min(inverter_power_budget, inverter_max_power.get());
+            power_budget += std::min(inverter_power_budget, l.inverter_max_power);
         }
 
         power_budget -= sit.consumption();
@@ -63,11 +109,14 @@ struct gen_impl : core::policy
         // follow the red policy in that case - otherwise we're risking a power failure.
         auto current_budget_red = red.apply(sit).current;
 
-        return core::budget{std::min(current_budget, current_budget_red)};
+        return core::budget{std::min(current_budget, current_budget_red), hold_battery ? std::optional{0.0} : std::nullopt, current_budget_red};
     }
 
     settings::param<double> m_max_grid_power;
     settings::param<double> m_min_solar_power;
+    uint64_t m_version = std::numeric_limits<uint64_t>::max(); // of the settings in m_limits, none yet
+    limits m_limits;
+    bool m_hold_battery = false; // kept until the conditions to release it are met, see apply()
 };
 
 struct orange_impl : gen_impl
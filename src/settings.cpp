@@ -4,51 +4,198 @@
 #include "mutex_protected.h"
 #include "www.h"
 
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <algorithm>
 #include <fstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace asio = boost::asio;
 
 using namespace settings;
 
 namespace {
 
-struct registry {
-    static auto lock() {
-        static mutex_protected<registry> instance;
-        return instance.lock();
+bool write_all(int fd, std::string_view data) {
+    while (not data.empty()) {
+        auto n = ::write(fd, data.data(), data.size());
+        if (n < 0 and errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        data.remove_prefix(n);
+    }
+    return true;
+}
+
+// Writes changed settings to disk on a thread of its own, so that whoever changes them does not wait for the SD card.
+// Changes are collected until none came in for settings.debounce ms, and then appended to a journal next to the
+// settings file as one line. The journal is folded into the settings file when it grows beyond settings.journal_size.
+class journal {
+public:
+    ~journal() {
+        asio::post(m_ioc, [this] {
+            m_timer.cancel();
+            flush();
+            m_work.reset();
+        });
+        if (m_thread.joinable())
+            m_thread.join();
+        if (m_fd >= 0)
+            ::close(m_fd);
     }
-    config::param<std::string> settings_file = {"settings_file", "p1faker-settings.json"};
-    std::map<std::string, std::vector<param_base*>> subscribers;
-    nlohmann::json all_settings;
 
-    registry() {
-        std::ifstream fin{settings_file};
+    // Reads the settings file with the changes from the journal on top, and starts writing changes
+    nlohmann::json load() {
+        std::ifstream fin{m_file};
         if (not fin.is_open()) {
-            logfinfo("Could not open settings file %s. Assuming factory defaults.", settings_file.get());
-            return;
+            logfinfo("Could not open settings file %s. Assuming factory defaults.", m_file.get());
+        } else {
+            try {
+                m_saved = nlohmann::json::parse(fin);
+            } catch (std::exception& e) {
+                logferror("Failed to deserialize settings file %s: %s", m_file.get(), e.what());
+            }
         }
-        try {
-            all_settings = nlohmann::json::parse(fin);
-        } catch (std::exception& e) {
-            logferror("Failed to deserialize settings file %s: %s", settings_file.get(), e.what());
+        if (not m_saved.is_object())
+            m_saved = nlohmann::json::object();
+
+        auto path = m_file.get() + ".journal";
+        std::ifstream jin{path};
+        std::string line;
+        std::size_t lines = 0;
+        while (std::getline(jin, line) and not jin.eof()) { // a last line without newline was not completely written
+            try {
+                auto changes = nlohmann::json::parse(line);
+                for (auto& [name, value] : changes.items())
+                    m_saved[name] = value;
+            } catch (std::exception& e) {
+                logferror("Failed to replay %s: %s", path, e.what());
+                break;
+            }
+            m_size += line.size() + 1;
+            lines++;
         }
+        if (lines > 0)
+            logfinfo("Replayed %d changes from %s", lines, path);
+
+        m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (m_fd < 0)
+            logfinfo("Could not open settings journal %s. Settings will not be persistent.", path);
+        else if (ftruncate(m_fd, m_size) < 0) // whatever could not be replayed
+            logferror("Failed to truncate %s: %s", path, strerror(errno));
+        m_thread = std::thread{[this] { m_ioc.run(); }};
+        return m_saved;
     }
 
-    void save() {
-        std::string tmpfile = settings_file.get() + ".tmp";
-        std::ofstream fout{tmpfile};
-        if (not fout.is_open()) {
-            logfinfo("Could not open settings file %s. Settings will not be persistent.", settings_file.get());
-            return;
-        }
-        try {
-            fout << all_settings;
-            fout.close();
-            rename(tmpfile.c_str(), settings_file.get().c_str());
-        } catch (std::exception& e) {
-            logferror("Failed to serialize settings file %s: %s", settings_file.get(), e.what());
-            return;
+    void record(const std::string& name, const nlohmann::json& value) {
+        asio::post(m_ioc, [this, name, value] {
+            auto now = std::chrono::steady_clock::now();
+            if (m_pending.empty())
+                m_first_pending = now;
+            m_pending[name] = value;
+            // a setting that keeps changing, e.g. from a script that posts it every second, is still written now and then
+            auto debounce = std::chrono::milliseconds{m_debounce};
+            m_timer.expires_at(std::min(now + debounce, m_first_pending + 10 * debounce));
+            wait();
+        });
+    }
+
+private:
+    void wait() {
+        m_timer.async_wait([this](boost::system::error_code ec) {
+            if (ec)
+                return;
+            if (flush()) {
+                m_retry = {};
+                return;
+            }
+            // keep the changes pending and try again, less often the longer the SD card keeps failing
+            m_retry = std::clamp(2 * m_retry, std::chrono::milliseconds{m_debounce}, std::chrono::milliseconds{std::chrono::minutes{5}});
+            m_timer.expires_after(m_retry);
+            wait();
+        });
+    }
+
+    // returns false if the changes could not be written, and are still pending
+    bool flush() {
+        if (m_pending.empty() or m_fd < 0)
+            return true;
+        auto line = m_pending.dump() + "\n";
+        if (not write_all(m_fd, line) or fdatasync(m_fd) < 0) {
+            logferror("Failed to write settings to %s.journal: %s", m_file.get(), strerror(errno));
+            if (ftruncate(m_fd, m_size) < 0) // a partial line would hide everything after it
+                logferror("Failed to truncate %s.journal: %s", m_file.get(), strerror(errno));
+            return false;
         }
-        logfdebug("Written settings to %s", settings_file.get());
+        for (auto& [name, value] : m_pending.items())
+            m_saved[name] = value;
+        m_size += line.size();
+        logfdebug("Written %d settings to %s.journal", m_pending.size(), m_file.get());
+        m_pending = nlohmann::json::object();
+        if (m_size > std::size_t(m_journal_size.get()))
+            compact();
+        return true;
+    }
+
+    // Replaces the settings file by one with the changes from the journal, and empties the journal
+    void compact() {
+        auto tmpfile = m_file.get() + ".tmp";
+        int fd = ::open(tmpfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return logferror("Could not open %s: %s", tmpfile, strerror(errno));
+        bool ok = write_all(fd, m_saved.dump()) and fsync(fd) == 0;
+        ::close(fd);
+        if (not ok or rename(tmpfile.c_str(), m_file.get().c_str()) < 0)
+            return logferror("Failed to write settings file %s: %s", m_file.get(), strerror(errno));
+        // after a crash right here, the journal is replayed onto a file that has its changes already, which is harmless
+        if (ftruncate(m_fd, 0) < 0)
+            return logferror("Failed to truncate %s.journal: %s", m_file.get(), strerror(errno));
+        m_size = 0;
+        logfdebug("Written settings to %s", m_file.get());
+    }
+
+    config::param<std::string> m_file{"settings_file", "p1faker-settings.json"};
+    config::param<int> m_debounce{"settings.debounce", 2000}; // ms without changes before they are written
+    config::param<int> m_journal_size{"settings.journal_size", 65536}; // bytes
+
+    // only used on m_thread, once loaded
+    nlohmann::json m_saved = nlohmann::json::object(); // what is on disk
+    nlohmann::json m_pending = nlohmann::json::object(); // what is not yet
+    std::chrono::steady_clock::time_point m_first_pending;
+    std::chrono::milliseconds m_retry{}; // after a failed write, 0 if the last write succeeded
+    int m_fd = -1; // the journal
+    std::size_t m_size = 0; // of the journal
+
+    asio::io_context m_ioc;
+    asio::steady_timer m_timer{m_ioc};
+    asio::executor_work_guard<asio::io_context::executor_type> m_work = asio::make_work_guard(m_ioc);
+    std::thread m_thread;
+};
+
+// Makes the changes in between visible to settings::read() all at once
+struct change {
+    change() {
+        detail::sequence.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
     }
+    ~change() { detail::sequence.fetch_add(1, std::memory_order_release); }
+};
+
+struct registry {
+    static auto lock() {
+        static mutex_protected<registry> instance;
+        return instance.lock();
+    }
+    journal m_journal;
+    std::map<std::string, std::vector<param_base*>> subscribers;
+    nlohmann::json all_settings = m_journal.load();
 };
 
 } // anonymous namespace
@@ -70,6 +217,7 @@ void param_base::load() {
         }
     }
     reg->subscribers[m_name].push_back(this);
+    www::publish("settings", reg->all_settings);
 }
 
 param_base::~param_base() {
@@ -91,6 +239,7 @@ void settings::apply(const nlohmann::json& settings) {
         return;
     }
     auto reg = registry::lock();
+    std::optional<change> changing;
     for (auto& [name, value] : settings.items()) {
         auto sett_it = reg->all_settings.find(name);
         auto subs_it = reg->subscribers.find(name);
@@ -98,11 +247,16 @@ void settings::apply(const nlohmann::json& settings) {
             logfwarn("POST settings: setting %s not found.", name);
             continue;
         }
+        if (*sett_it == value)
+            continue; // nothing to write
+        if (not changing)
+            changing.emplace();
         try {
             for (auto& subscriber : subs_it->second) {
                 subscriber->setjson(value);
             }
             *sett_it = value;
+            reg->m_journal.record(name, value);
             logfdebug("POST settings: changed %s to %s", name, value.dump());
         } catch (std::exception& e) {
             logfwarn("POST settings: failed to parse %s as value for settings %s: %s", value.dump(), name, e.what());
@@ -110,7 +264,17 @@ void settings::apply(const nlohmann::json& settings) {
             // but we assume they all apply the same validation rules.
         }
     }
-    reg->save();
+    changing.reset();
+    www::publish("settings", reg->all_settings);
+}
+
+std::optional<nlohmann::json> settings::get(std::string_view name) {
+    auto reg = registry::lock();
+    auto subs_it = reg->subscribers.find(std::string{name});
+    auto sett_it = reg->all_settings.find(name);
+    if (subs_it == reg->subscribers.end() or subs_it->second.empty() or sett_it == reg->all_settings.end())
+        return std::nullopt;
+    return *sett_it;
 }
 
 namespace {
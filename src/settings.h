@@ -2,15 +2,77 @@
 #define SETTINGS_H_
 
 #include "config.h"
-#include "mutex_protected.h"
 
+#include <atomic>
+#include <memory>
 #include <optional>
 #include <string_view>
+#include <thread>
+#include <type_traits>
 #include <nlohmann/json.hpp>
 
 namespace settings
 {
 
+namespace detail
+{
+
+// odd while apply() is changing settings
+inline std::atomic<uint64_t> sequence = 0;
+
+template<typename T, typename = void>
+struct lock_free : std::false_type {};
+
+template<typename T>
+struct lock_free<T, std::enable_if_t<std::is_trivially_copyable_v<T>>> : std::bool_constant<std::atomic<T>::is_always_lock_free> {};
+
+// a value that can be read without taking a mutex: in a plain atomic if possible, otherwise in an immutable copy
+template<typename T, bool = lock_free<T>::value>
+class atomic_value
+{
+public:
+    explicit atomic_value(const T& value) : m_value{value} {}
+    T load() const { return m_value.load(std::memory_order_acquire); }
+    void store(const T& value) { m_value.store(value, std::memory_order_release); }
+private:
+    std::atomic<T> m_value;
+};
+
+template<typename T>
+class atomic_value<T, false>
+{
+public:
+    explicit atomic_value(const T& value) : m_value{std::make_shared<const T>(value)} {}
+    T load() const { return *m_value.load(std::memory_order_acquire); }
+    void store(const T& value) { m_value.store(std::make_shared<const T>(value), std::memory_order_release); }
+private:
+    std::atomic<std::shared_ptr<const T>> m_value;
+};
+
+} // namespace detail
+
+/** Changes whenever settings change, so that values derived from settings can be kept until it does. */
+inline uint64_t version() { return detail::sequence.load(std::memory_order_acquire); }
+
+/**
+ * Returns f(), called again if settings changed meanwhile, so that it sees either all or none of the changes of one
+ * apply(). Only needed when several settings must fit together: a single get() is consistent by itself.
+ */
+template<typename F>
+auto read(F&& f)
+{
+    while (true) {
+        auto v = version();
+        if (v % 2 == 0) {
+            auto result = f();
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (detail::sequence.load(std::memory_order_relaxed) == v)
+                return result;
+        }
+        std::this_thread::yield();
+    }
+}
+
 class param_base
 {
 public:
@@ -34,28 +96,32 @@ class param : param_base
 public:
     param(std::string_view name, const T& hard_default)
     : param_base(name)
+    , m_value{config::param<T, Parser>{name, hard_default}.get()}
     {
-        *m_value.lock() = config::param<T, Parser>{name, hard_default}.get();
         load();
     }
 
     std::string_view name() const { return m_name; }
 
-    T get() const { return *m_value.lock(); }
+    T get() const { return m_value.load(); }
     operator T() const { return get(); }
 
 protected:
-    void setjson(const nlohmann::json& j) override { *m_value.lock() = j.get<T>(); }
-    void getjson(nlohmann::json& j) override { j = *m_value.lock(); }
+    void setjson(const nlohmann::json& j) override { m_value.store(j.get<T>()); }
+    void getjson(nlohmann::json& j) override { j = m_value.load(); }
 private:
-    mutex_protected<T> m_value;
+    detail::atomic_value<T> m_value;
 };
 
 // to be used in html to include editable text to display and manipulate that want to include an input field for managing a setting
 std::string html(const param<double>& param);
 
+// changes the settings named in the object, all at once for read()
 void apply(const nlohmann::json& j);
 
+// the value of a setting that a module registered, or nothing if no module has one by that name
+std::optional<nlohmann::json> get(std::string_view name);
+
 } // namespace settings
 
 #endif /* SETTINGS_H_ */
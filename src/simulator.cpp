@@ -13,6 +13,8 @@ config::param<int> default_car_min_power{"simulator.car_min_power", 5500};
 config::param<int> default_car_max_power{"simulator.car_max_power", 11000};
 config::param<int> default_inverter_max_power{"inverter_max_power", 8000};
 config::param<int> default_battery_max_power{"battery_max_power", 5000};
+config::param<int> default_car_ramp_rate{"simulator.car_ramp_rate", 0};
+config::param<int> interval{"interval", 1000, config::reloadable};
 
 struct simulator : core::producer, core::consumer
 {
@@ -21,6 +23,7 @@ struct simulator : core::producer, core::consumer
         struct input {
             int car_min_power = default_car_min_power.get();
             int car_max_power = default_car_max_power.get();
+            int car_ramp_rate = default_car_ramp_rate.get(); // W/s, 0 to follow the budget immediately
             int inverter_max_power = default_inverter_max_power.get();
             int battery_max_power = default_battery_max_power.get();
             int battery_state = 50;
@@ -53,6 +56,8 @@ struct simulator : core::producer, core::consumer
 
     simulator() : core::producer("simulator"), core::consumer("simulator") {}
 
+    static void publish(const state::output&); // defined after the JSON conversions
+
     void poll(core::situation& sit) override
     {
         auto s = m_state.lock();
@@ -90,20 +95,24 @@ struct simulator : core::producer, core::consumer
     void handle(const core::budget& b, const core::situation& sit) override
     {
         auto s = m_state.lock();
-        int car_power = s->o.car_power + int(b.current * sit.grid_voltage() * sit.grid.size());
+        int car_power = s->o.car_power + int(std::lround(b.current * sit.grid_voltage() * sit.grid.size()));
         if (car_power > s->i.car_max_power) car_power = s->i.car_max_power;
         if (car_power < s->i.car_min_power) car_power = 0;
+        if (car_power != 0 and s->i.car_ramp_rate > 0) {
+            int ramp = s->i.car_ramp_rate * interval.get() / 1000;
+            car_power = std::clamp(car_power, s->o.car_power - ramp, s->o.car_power + ramp);
+        }
         if (s->o.car_power != car_power) logfinfo("Charging car at %s W", car_power);
         s->o.car_power = car_power;
+        publish(s->o);
     }
 };
 
 std::optional<simulator> impl;
 config::param<bool> enable{"simulator.enable", false};
-int _ = [] {
+int _ = core::at_startup([] {
     if (enable) impl.emplace();
-    return 0;
-}();
+});
 
 void from_json(const nlohmann::json& j, simulator::state::input& s)
 {
@@ -111,6 +120,7 @@ void from_json(const nlohmann::json& j, simulator::state::input& s)
     j.at("solar_power").get_to(s.solar_power);
     j.at("car_min_power").get_to(s.car_min_power);
     j.at("car_max_power").get_to(s.car_max_power);
+    j.at("car_ramp_rate").get_to(s.car_ramp_rate);
     j.at("inverter_max_power").get_to(s.inverter_max_power);
     j.at("battery_max_power").get_to(s.battery_max_power);
     for (std::size_t i = 0; ; i++)
@@ -128,6 +138,7 @@ void to_json(nlohmann::json& j, const simulator::state::input& s)
         {"solar_power", s.solar_power},
         {"car_min_power", s.car_min_power},
         {"car_max_power", s.car_max_power},
+        {"car_ramp_rate", s.car_ramp_rate},
         {"inverter_max_power", s.inverter_max_power},
         {"battery_max_power", s.battery_max_power},
     };
@@ -145,4 +156,9 @@ void to_json(nlohmann::json& j, const simulator::state::output& s)
         j[str(boost::format("grid_power_l%d") % (i + 1))] = s.grid_power[i];
 }
 
+void simulator::publish(const state::output& o)
+{
+    www::publish("simulator", o);
+}
+
 } // anonymous namespace
@@ -5,14 +5,15 @@
 #include "service_discovery.h"
 
 #include <atomic>
+#include <chrono>
 
 namespace
 {
 
-struct producer_impl : core::producer, service_discovery::subscriber
+struct producer_impl : core::producer, core::consumer, service_discovery::subscriber
 {
     producer_impl()
-    : core::producer("sma"), service_discovery::subscriber("_http._tcp")
+    : core::producer("sma"), core::consumer("sma"), service_discovery::subscriber("_http._tcp")
     , m_conn("SMA inverter")
     {}
 
@@ -31,6 +32,13 @@ struct producer_impl : core::producer, service_discovery::subscriber
         power_grid_drawn_l1 = 31265,
         power_grid_drawn_l2 = 31267,
         power_grid_drawn_l3 = 31269,
+        battery_power_setpoint = 40149,
+        battery_control_mode = 40151,
+    };
+    enum battery_control_mode_value
+    {
+        external_control_active = 802,
+        external_control_inactive = 803,
     };
     static const uint8_t unit_id = 3;
 
@@ -62,6 +70,36 @@ struct producer_impl : core::producer, service_discovery::subscriber
         }
     }
 
+    void handle(const core::budget& b, const core::situation&) override
+    {
+        if (not m_battery_control)
+            return;
+
+        if (b.battery_output) {
+            auto setpoint = int32_t(std::lround(*b.battery_output));
+            auto tnow = std::chrono::steady_clock::now();
+            // the inverter falls back to its own control loop if the setpoint is not refreshed in time
+            if (m_battery_setpoint == setpoint and tnow < m_battery_written + std::chrono::seconds{m_battery_refresh})
+                return;
+            modbus::register_vector reg{battery_power_setpoint, 4};
+            reg.set<int32_t>(battery_power_setpoint, setpoint);
+            reg.set<uint32_t>(battery_control_mode, external_control_active);
+            if (not m_conn.write_multiple_registers(unit_id, reg))
+                return;
+            if (m_battery_setpoint != setpoint)
+                logfdebug("Set battery power setpoint to %d W", setpoint);
+            m_battery_setpoint = setpoint;
+            m_battery_written = tnow;
+        } else if (m_battery_setpoint) {
+            modbus::register_vector reg{battery_control_mode, 2};
+            reg.set<uint32_t>(battery_control_mode, external_control_inactive);
+            if (not m_conn.write_multiple_registers(unit_id, reg))
+                return;
+            logfdebug("Released battery power setpoint");
+            m_battery_setpoint.reset();
+        }
+    }
+
     bool match(std::string_view name) override {
         return name.find("SMA-Inverter") != std::string::npos;
     }
@@ -76,6 +114,10 @@ struct producer_impl : core::producer, service_discovery::subscriber
     }
 
     config::param<uint16_t> m_port{"sma.port", 502};
+    config::param<bool> m_battery_control{"sma.battery_control", false};
+    config::param<int> m_battery_refresh{"sma.battery_refresh", 60}; // seconds
+    std::optional<int32_t> m_battery_setpoint;
+    std::chrono::steady_clock::time_point m_battery_written;
     modbus::connection m_conn;
     std::atomic<bool> m_endpoints_changed = false;
 } impl;
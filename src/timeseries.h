@@ -0,0 +1,187 @@
+#ifndef TIMESERIES_H_
+#define TIMESERIES_H_
+
+#include "core.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+namespace timeseries {
+
+/** A quantity that is recorded each tick, for the history and the archive. */
+struct field {
+    std::string_view name;
+    double (*get)(const core::budget&, const core::situation&);
+};
+
+inline constexpr std::array fields = {
+    field{"battery_state", [](const core::budget&, const core::situation& sit) { return sit.battery_state; }},
+    field{"inverter_output", [](const core::budget&, const core::situation& sit) { return sit.inverter_output; }},
+    field{"battery_output", [](const core::budget&, const core::situation& sit) { return sit.battery_output; }},
+    field{"solar_output", [](const core::budget&, const core::situation& sit) { return sit.solar_output(); }},
+    field{"grid_output", [](const core::budget&, const core::situation& sit) { return sit.grid_output(); }},
+    field{"consumption", [](const core::budget&, const core::situation& sit) { return sit.consumption(); }},
+    field{"budget_current", [](const core::budget& b, const core::situation&) { return b.current; }},
+    field{"budget_battery_output", [](const core::budget& b, const core::situation&) {
+        return b.battery_output.value_or(std::numeric_limits<double>::quiet_NaN());
+    }},
+};
+
+/** Whether a comma separated list like "solar_output,consumption" contains the name. */
+inline bool contains(std::string_view list, std::string_view name) {
+    while (not list.empty()) {
+        auto end = std::min(list.find(','), list.size());
+        if (list.substr(0, end) == name)
+            return true;
+        list.remove_prefix(std::min(end + 1, list.size()));
+    }
+    return false;
+}
+
+/** Minimum, maximum and average of the samples in an interval. NaN if there were no samples. */
+struct aggregate {
+    float min = std::numeric_limits<float>::quiet_NaN();
+    float max = std::numeric_limits<float>::quiet_NaN();
+    float avg = std::numeric_limits<float>::quiet_NaN();
+};
+
+/** Builds an aggregate from samples one by one. NaN samples are ignored. */
+class accumulator {
+public:
+    void add(double value) {
+        if (std::isnan(value))
+            return;
+        m_min = std::min(m_min, value);
+        m_max = std::max(m_max, value);
+        m_sum += value;
+        m_count++;
+    }
+
+    aggregate get() const {
+        if (m_count == 0)
+            return aggregate{};
+        return aggregate{float(m_min), float(m_max), float(m_sum / m_count)};
+    }
+
+private:
+    double m_min = std::numeric_limits<double>::infinity();
+    double m_max = -std::numeric_limits<double>::infinity();
+    double m_sum = 0.0;
+    std::size_t m_count = 0;
+};
+
+/** Buffer that is allocated once and then overwrites its oldest element when full. Element 0 is the oldest. */
+template<typename T>
+class ring {
+public:
+    explicit ring(std::size_t capacity) : m_data(capacity) {}
+
+    std::size_t capacity() const { return m_data.size(); }
+    std::size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    void push(const T& value) {
+        m_data[(m_begin + m_size) % m_data.size()] = value;
+        if (m_size < m_data.size())
+            m_size++;
+        else
+            m_begin = (m_begin + 1) % m_data.size();
+    }
+
+    const T& operator[](std::size_t i) const { return m_data[(m_begin + i) % m_data.size()]; }
+    const T& back() const { return (*this)[m_size - 1]; }
+
+private:
+    std::vector<T> m_data;
+    std::size_t m_begin = 0;
+    std::size_t m_size = 0;
+};
+
+/** Index of the first element for which time(i) >= t, in elements [begin, end) that are ordered by time. */
+template<typename Time>
+std::size_t lower_bound(std::size_t begin, std::size_t end, int64_t t, Time&& time) {
+    while (begin < end) {
+        auto mid = begin + (end - begin) / 2;
+        if (time(mid) < t)
+            begin = mid + 1;
+        else
+            end = mid;
+    }
+    return begin;
+}
+
+/** A point picked by lttb: its index and the range of points [begin, end) it stands for. */
+struct pick {
+    std::size_t index;
+    std::size_t begin;
+    std::size_t end;
+};
+
+/**
+ * Largest-Triangle-Three-Buckets downsampling (Steinarsson, 2013) of the points 0 .. count-1, given by x(i) and y(i),
+ * to at most threshold points that keep the visual shape of the series. Points for which y is NaN are never picked,
+ * unless a bucket has nothing else. All points are picked if there are no more than threshold.
+ */
+template<typename X, typename Y>
+std::vector<pick> lttb(std::size_t count, std::size_t threshold, X&& x, Y&& y) {
+    std::vector<pick> result;
+    if (count <= threshold or threshold < 3) {
+        result.reserve(count);
+        for (std::size_t i = 0; i < count; i++)
+            result.push_back(pick{i, i, i + 1});
+        return result;
+    }
+    result.reserve(threshold);
+    result.push_back(pick{0, 0, 1});
+    // the points in between the first and the last go into threshold - 2 buckets of equal size
+    double size = double(count - 2) / double(threshold - 2);
+    auto bucket_begin = [&](std::size_t b) { return 1 + std::size_t(b * size); };
+    std::size_t a = 0; // point picked in the previous bucket
+    for (std::size_t b = 0; b < threshold - 2; b++) {
+        auto begin = bucket_begin(b), end = bucket_begin(b + 1);
+        // average of the next bucket, or the last point if this is the last bucket
+        double avg_x = 0.0, avg_y = 0.0;
+        std::size_t n = 0;
+        auto next_begin = end, next_end = b + 3 < threshold ? bucket_begin(b + 2) : count;
+        for (auto i = next_begin; i < next_end; i++) {
+            if (std::isnan(y(i)))
+                continue;
+            avg_x += x(i);
+            avg_y += y(i);
+            n++;
+        }
+        if (n > 0) {
+            avg_x /= n;
+            avg_y /= n;
+        } else {
+            avg_x = x(next_end - 1);
+            avg_y = y(a);
+        }
+        double ax = x(a), ay = std::isnan(y(a)) ? avg_y : y(a);
+        std::size_t best = begin;
+        double best_area = -1.0;
+        for (auto i = begin; i < end; i++) {
+            if (std::isnan(y(i)))
+                continue;
+            double area = std::abs((ax - avg_x) * (y(i) - ay) - (ax - x(i)) * (avg_y - ay));
+            if (area > best_area) {
+                best_area = area;
+                best = i;
+            }
+        }
+        result.push_back(pick{best, begin, end});
+        a = best;
+    }
+    result.push_back(pick{count - 1, count - 1, count});
+    return result;
+}
+
+} // namespace timeseries
+
+#endif /* TIMESERIES_H_ */
@@ -0,0 +1,59 @@
+#include "logf.h"
+#include "www.h"
+
+#include <optional>
+#include <sstream>
+
+namespace
+{
+
+std::string label(logseverity::type sev)
+{
+    std::ostringstream os;
+    os << sev;
+    return os.str();
+}
+
+struct request
+{
+    std::string file; // end of the path, like "p1out.cpp"
+    int line = 0; // 0 for all lines in the file
+    std::optional<logseverity::type> verbosity; // null to follow the global verbosity again
+};
+
+void from_json(const nlohmann::json& j, request& r)
+{
+    r.file = j.at("file").get<std::string>();
+    r.line = j.value("line", 0);
+    if (j.contains("verbosity") and not j.at("verbosity").is_null()) {
+        std::istringstream is{j.at("verbosity").get<std::string>()};
+        r.verbosity.emplace();
+        is >> *r.verbosity;
+    }
+}
+
+// GET lists the call sites that have been reached, POST changes the verbosity of some of them while running
+www::rpc get_rpc = www::rpc::get("verbosity", [] {
+    auto j = nlohmann::json::array();
+    for (auto& c : logdetail::list_callsites()) {
+        j.push_back({
+            {"file", c.file},
+            {"line", c.line},
+            {"severity", label(c.sev)},
+            {"format", c.fmt},
+            {"verbosity", c.verbosity ? nlohmann::json(label(*c.verbosity)) : nlohmann::json()},
+            {"enabled", c.enabled},
+        });
+    }
+    return j;
+});
+
+www::rpc set_rpc = www::rpc::post<request>("verbosity", [](const request& r) {
+    logdetail::set_verbosity(r.file, r.line, r.verbosity);
+    if (r.verbosity)
+        logfinfo("Verbosity of %s:%d set to %s", r.file, r.line, label(*r.verbosity));
+    else
+        logfinfo("Verbosity of %s:%d follows the global verbosity again", r.file, r.line);
+});
+
+} // anonymous namespace
@@ -1,16 +1,30 @@
 #include "www.h"
+#include "assets.h"
 #include "config.h"
 #include "logf.h"
+#include "metrics.h"
 #include "mutex_protected.h"
 #include "service_discovery.h"
 
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/algorithm/string/trim.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/asio/dispatch.hpp>
+#include <boost/asio/post.hpp>
 #include <boost/asio/strand.hpp>
+#include <boost/asio/write.hpp>
 #include <boost/config.hpp>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <atomic>
+#include <deque>
 #include <functional>
 #include <memory>
+#include <sstream>
 #include <thread>
 
 using namespace www;
@@ -24,45 +38,486 @@ using namespace std::literals::chrono_literals;
 
 namespace {
 
-// Return a reasonable mime type based on the extension of a file.
-beast::string_view mime_type(beast::string_view path) {
-    using beast::iequals;
-    auto const ext = [&path] {
-        auto const pos = path.rfind(".");
-        if(pos == beast::string_view::npos)
-            return beast::string_view{};
-        return path.substr(pos);
-    }();
-    if (iequals(ext, ".html")) return "text/html";
-    if (iequals(ext, ".css"))  return "text/css";
-    if (iequals(ext, ".js"))   return "text/javascript";
-    if (iequals(ext, ".json")) return "application/json";
-    if (iequals(ext, ".png"))  return "image/png";
-    if (iequals(ext, ".jpg"))  return "image/jpeg";
-    return "application/octet-stream";
-}
-
 struct ip_parser {
     asio::ip::address operator()(std::string_view text) { return asio::ip::make_address(text); }
 };
 
 constexpr const char* http_server = "p1faker/1.0";
-config::param<std::string> doc_root{"www.doc_root", "public"};
 
-struct rpc_value {
+// by class of status code
+metrics::counter http_requests[] = {
+    {"p1faker_http_requests_total", "HTTP requests served, by class of status code", "code=\"1xx\""},
+    {"p1faker_http_requests_total", "HTTP requests served, by class of status code", "code=\"2xx\""},
+    {"p1faker_http_requests_total", "HTTP requests served, by class of status code", "code=\"3xx\""},
+    {"p1faker_http_requests_total", "HTTP requests served, by class of status code", "code=\"4xx\""},
+    {"p1faker_http_requests_total", "HTTP requests served, by class of status code", "code=\"5xx\""},
+};
+
+// Body of a response that refers to a cached buffer instead of holding a copy
+struct shared_body {
+    using value_type = std::shared_ptr<const std::string>;
+
+    static std::uint64_t size(const value_type& body) { return body->size(); }
+
+    class writer {
+    public:
+        using const_buffers_type = asio::const_buffer;
+
+        template<bool isRequest, class Fields>
+        writer(const http::header<isRequest, Fields>&, const value_type& body) : m_body(body) {}
+
+        void init(beast::error_code& ec) { ec = {}; }
+
+        boost::optional<std::pair<const_buffers_type, bool>> get(beast::error_code& ec) {
+            ec = {};
+            return {{asio::const_buffer{m_body->data(), m_body->size()}, false}};
+        }
+
+    private:
+        const value_type& m_body;
+    };
+};
+
+// Output in segments of a fixed size, so that a large response never has to be moved to grow it
+class segments {
+public:
+    static constexpr std::size_t segment_size = 16 * 1024;
+
+    void append(std::string_view data) {
+        while (not data.empty()) {
+            if (m_segments.empty() or m_segments.back().size() == segment_size) {
+                m_segments.emplace_back();
+                m_segments.back().reserve(segment_size);
+            }
+            auto n = std::min(data.size(), segment_size - m_segments.back().size());
+            m_segments.back().append(data.substr(0, n));
+            data.remove_prefix(n);
+        }
+    }
+    void append(char c) { append(std::string_view{&c, 1}); }
+
+    std::vector<std::string> release() { return std::move(m_segments); }
+
+private:
+    std::vector<std::string> m_segments;
+};
+
+// Body of a response that was written in segments, each of which becomes a chunk if it is sent chunked
+struct segmented_body {
+    using value_type = std::vector<std::string>;
+
+    static std::uint64_t size(const value_type& body) {
+        std::uint64_t result = 0;
+        for (auto& segment : body)
+            result += segment.size();
+        return result;
+    }
+
+    class writer {
+    public:
+        using const_buffers_type = asio::const_buffer;
+
+        template<bool isRequest, class Fields>
+        writer(const http::header<isRequest, Fields>&, const value_type& body) : m_body(body) {}
+
+        void init(beast::error_code& ec) { ec = {}; }
+
+        boost::optional<std::pair<const_buffers_type, bool>> get(beast::error_code& ec) {
+            ec = {};
+            if (m_next == m_body.size())
+                return boost::none;
+            auto& segment = m_body[m_next++];
+            return {{asio::const_buffer{segment.data(), segment.size()}, m_next < m_body.size()}};
+        }
+
+    private:
+        const value_type& m_body;
+        std::size_t m_next = 0;
+    };
+};
+
+class text_writer : public json_writer {
+public:
+    explicit text_writer(segments& out) : m_out(out) {}
+
+    void begin_object() override { separate(); m_out.append('{'); m_first.push_back(true); }
+    void end_object() override { m_out.append('}'); m_first.pop_back(); }
+    void begin_array() override { separate(); m_out.append('['); m_first.push_back(true); }
+    void end_array() override { m_out.append(']'); m_first.pop_back(); }
+    void key(std::string_view k) override { separate(); string(k); m_out.append(':'); m_after_key = true; }
+    void value(std::string_view v) override { separate(); string(v); }
+    void value(double v) override {
+        separate();
+        if (not std::isfinite(v))
+            return m_out.append("null");
+        char buffer[32];
+        auto [end, ec] = std::to_chars(buffer, buffer + sizeof buffer, v);
+        m_out.append(std::string_view{buffer, std::size_t(end - buffer)});
+    }
+    void value(int64_t v) override {
+        separate();
+        char buffer[24];
+        auto [end, ec] = std::to_chars(buffer, buffer + sizeof buffer, v);
+        m_out.append(std::string_view{buffer, std::size_t(end - buffer)});
+    }
+    void value(bool v) override { separate(); m_out.append(v ? "true" : "false"); }
+    void null() override { separate(); m_out.append("null"); }
+    using json_writer::value;
+
+private:
+    void separate() {
+        if (m_after_key)
+            m_after_key = false;
+        else if (not m_first.empty() and m_first.back())
+            m_first.back() = false;
+        else if (not m_first.empty())
+            m_out.append(',');
+    }
+
+    void string(std::string_view text) {
+        m_out.append('"');
+        std::size_t start = 0;
+        for (std::size_t i = 0; i < text.size(); i++) {
+            auto c = static_cast<unsigned char>(text[i]);
+            if (c >= 0x20 and c != '"' and c != '\\')
+                continue;
+            m_out.append(text.substr(start, i - start));
+            start = i + 1;
+            if (c == '"') m_out.append("\\\"");
+            else if (c == '\\') m_out.append("\\\\");
+            else if (c == '\n') m_out.append("\\n");
+            else {
+                char escaped[8];
+                std::snprintf(escaped, sizeof escaped, "\\u%04x", c);
+                m_out.append(escaped);
+            }
+        }
+        m_out.append(text.substr(start));
+        m_out.append('"');
+    }
+
+    segments& m_out;
+    std::vector<bool> m_first; // per open object or array, whether nothing was written in it yet
+    bool m_after_key = false;
+};
+
+// RFC 8949, with maps and arrays of indefinite length, as their sizes are not known up front
+class cbor_writer : public json_writer {
+public:
+    explicit cbor_writer(segments& out) : m_out(out) {}
+
+    void begin_object() override { m_out.append(char(0xbf)); }
+    void end_object() override { m_out.append(char(0xff)); }
+    void begin_array() override { m_out.append(char(0x9f)); }
+    void end_array() override { m_out.append(char(0xff)); }
+    void key(std::string_view k) override { value(k); }
+    void value(std::string_view v) override { head(3, v.size()); m_out.append(v); }
+    void value(double v) override {
+        auto bits = std::bit_cast<uint64_t>(v);
+        m_out.append(char(0xfb));
+        for (int shift = 56; shift >= 0; shift -= 8)
+            m_out.append(char(bits >> shift));
+    }
+    void value(int64_t v) override { v >= 0 ? head(0, v) : head(1, uint64_t(-1 - v)); }
+    void value(bool v) override { m_out.append(char(v ? 0xf5 : 0xf4)); }
+    void null() override { m_out.append(char(0xf6)); }
+    using json_writer::value;
+
+private:
+    void head(uint8_t major, uint64_t n) {
+        int bytes = n < 24 ? 0 : n <= 0xff ? 1 : n <= 0xffff ? 2 : n <= 0xffffffff ? 4 : 8;
+        m_out.append(char(major << 5 | (bytes == 0 ? n : bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27)));
+        for (int i = bytes - 1; i >= 0; i--)
+            m_out.append(char(n >> (8 * i)));
+    }
+
+    segments& m_out;
+};
+
+// Whether an If-None-Match header lists the given entity tag (weak comparison, as prescribed for If-None-Match)
+bool matches(std::string_view if_none_match, std::string_view etag) {
+    while (not if_none_match.empty()) {
+        auto end = std::min(if_none_match.find(','), if_none_match.size());
+        auto tag = if_none_match.substr(0, end);
+        if_none_match.remove_prefix(std::min(end + 1, if_none_match.size()));
+        while (not tag.empty() and tag.front() == ' ') tag.remove_prefix(1);
+        while (not tag.empty() and tag.back() == ' ') tag.remove_suffix(1);
+        if (tag.starts_with("W/")) tag.remove_prefix(2);
+        if (tag == "*" or tag == etag)
+            return true;
+    }
+    return false;
+}
+
+// An encoding of JSON values that RPCs take and return
+struct format {
+    std::string_view mime_type;
+    nlohmann::json (*parse)(std::string_view body);
+    void (*serialize)(const nlohmann::json& value, std::string& body);
+};
+
+const std::array formats = {
+    format{"application/json",
+        [](std::string_view body) { return nlohmann::json::parse(body); },
+        [](const nlohmann::json& value, std::string& body) { body = value.dump(); }},
+    format{"application/cbor",
+        [](std::string_view body) { return nlohmann::json::from_cbor(body); },
+        [](const nlohmann::json& value, std::string& body) { nlohmann::json::to_cbor(value, body); }},
+    format{"application/msgpack",
+        [](std::string_view body) { return nlohmann::json::from_msgpack(body); },
+        [](const nlohmann::json& value, std::string& body) { nlohmann::json::to_msgpack(value, body); }},
+    format{"application/x-msgpack",
+        [](std::string_view body) { return nlohmann::json::from_msgpack(body); },
+        [](const nlohmann::json& value, std::string& body) { nlohmann::json::to_msgpack(value, body); }},
+};
+
+// "Application/CBOR; charset=x" -> "application/cbor"
+std::string media_type(std::string_view text) {
+    std::string result{text.substr(0, std::min(text.find(';'), text.size()))};
+    boost::algorithm::trim(result);
+    boost::algorithm::to_lower(result);
+    return result;
+}
+
+// The format of a request body, or nullptr if RPCs do not understand it
+const format* find_format(std::string_view content_type) {
+    auto type = media_type(content_type);
+    auto it = std::find_if(formats.begin(), formats.end(), [&](const format& f) { return f.mime_type == type; });
+    return it == formats.end() ? nullptr : &*it;
+}
+
+// The format the client prefers according to its Accept header: JSON unless it asks for a binary one
+const format& negotiate(std::string_view accept) {
+    const format* best = &formats.front();
+    double best_q = 0.0;
+    while (not accept.empty()) {
+        auto end = std::min(accept.find(','), accept.size());
+        auto item = accept.substr(0, end);
+        accept.remove_prefix(std::min(end + 1, accept.size()));
+        double q = 1.0;
+        if (auto params = item.find(';'); params != std::string_view::npos)
+            if (auto pos = item.find("q=", params); pos != std::string_view::npos)
+                q = std::atof(std::string{item.substr(pos + 2)}.c_str());
+        auto type = media_type(item);
+        const format* f = type == "*/*" or type == "application/*" ? &formats.front() : find_format(type);
+        if (f and q > best_q) {
+            best = f;
+            best_q = q;
+        }
+    }
+    return *best;
+}
+
+// Decodes the parameters of a query string like "from=1700000000&fields=solar_output%2Cconsumption" into a JSON object
+nlohmann::json parse_query(std::string_view query) {
+    auto decode = [](std::string_view text) {
+        std::string result;
+        for (std::size_t i = 0; i < text.size(); i++) {
+            if (text[i] == '+')
+                result += ' ';
+            else if (text[i] == '%' and i + 2 < text.size() and std::isxdigit(static_cast<unsigned char>(text[i + 1]))
+                    and std::isxdigit(static_cast<unsigned char>(text[i + 2]))) {
+                result += char(std::stoi(std::string{text.substr(i + 1, 2)}, nullptr, 16));
+                i += 2;
+            } else
+                result += text[i];
+        }
+        return result;
+    };
+    auto result = nlohmann::json::object();
+    while (not query.empty()) {
+        auto end = std::min(query.find('&'), query.size());
+        auto param = query.substr(0, end);
+        query.remove_prefix(std::min(end + 1, query.size()));
+        if (param.empty())
+            continue;
+        auto eq = std::min(param.find('='), param.size());
+        auto value = decode(param.substr(std::min(eq + 1, param.size())));
+        auto number = nlohmann::json::parse(value, nullptr, false);
+        result[decode(param.substr(0, eq))] = number.is_number() ? number : nlohmann::json(value);
+    }
+    return result;
+}
+
+struct rpc_entry {
     rpc* instance;
-    std::function<void(const nlohmann::json&, nlohmann::json&)> handler;
+    std::function<void(const nlohmann::json&, nlohmann::json&)> handler; // either this one
+    std::function<void(const nlohmann::json&, json_writer&)> stream; // or this one is set
+    std::atomic<int> calls = 0; // in progress
+    std::atomic<bool> retired = false; // unregistered, so no new calls
 };
 
+// The RPCs are published as an immutable snapshot of the table, so that a request finds its handler without taking any
+// lock and a slow handler does not hold up other requests. Only (un)registering is serialized, by the mutex, and
+// publishes a new copy of the table.
 struct registry {
-    static auto lock() {
+    using table = std::map<rpc::key, std::shared_ptr<rpc_entry>>;
+
+    static auto& instance() {
         static mutex_protected<registry> instance;
-        return instance.lock();
+        return instance;
+    }
+    static auto lock() { return instance().lock(); }
+
+    // Returns the entry for the key, or nullptr if there is none. The entry counts as being called until the last copy
+    // of the returned pointer is gone, which holds off the destructor of its rpc.
+    static std::shared_ptr<const rpc_entry> find(const rpc::key& key) {
+        auto tbl = snapshot().load();
+        auto it = tbl->find(key);
+        if (it == tbl->end())
+            return nullptr;
+        auto entry = it->second;
+        entry->calls++;
+        if (entry->retired) { // unregistered after we loaded the snapshot: the rpc might not wait for us anymore
+            release(*entry);
+            return nullptr;
+        }
+        return std::shared_ptr<const rpc_entry>{entry.get(), [entry](const rpc_entry*) { release(*entry); }};
     }
 
-    std::map<rpc::key, rpc_value> rpcs;
+    // for use under the lock
+    std::shared_ptr<rpc_entry> get(const rpc::key& key) const {
+        auto tbl = snapshot().load();
+        auto it = tbl->find(key);
+        return it == tbl->end() ? nullptr : it->second;
+    }
+
+    template<typename F>
+    void modify(F&& f) {
+        auto tbl = std::make_shared<table>(*snapshot().load());
+        f(*tbl);
+        snapshot().store(std::move(tbl));
+    }
+
+    // Publishes the entry for its key. An entry it overrules is retired and waited for here, just like the destructor
+    // of its rpc would do, because that destructor does not find it anymore.
+    static void add(const rpc::key& key, std::shared_ptr<rpc_entry> entry) {
+        std::shared_ptr<rpc_entry> replaced;
+        lock()->modify([&](table& tbl) {
+            replaced = std::exchange(tbl[key], std::move(entry));
+            logfdebug("%s RPC %s", replaced ? "Overrule" : "Register", key);
+        });
+        if (replaced) {
+            replaced->retired = true;
+            drain(*replaced);
+        }
+    }
+
+    // Waits for the calls that found a retired entry. Its handler may refer to the owner of its rpc, so that must
+    // outlive them.
+    static void drain(rpc_entry& entry) {
+        for (int calls = entry.calls; calls != 0; calls = entry.calls)
+            entry.calls.wait(calls);
+    }
+
+private:
+    static std::atomic<std::shared_ptr<const table>>& snapshot() {
+        static std::atomic<std::shared_ptr<const table>> instance{std::make_shared<const table>()};
+        return instance;
+    }
+
+    static void release(rpc_entry& entry) {
+        if (--entry.calls == 0)
+            entry.calls.notify_all();
+    }
 };
 
+// Returns the result of an RPC as nlohmann::json, also if its handler writes it with a json_writer
+nlohmann::json invoke(const rpc_entry& rpc, const nlohmann::json& in) {
+    nlohmann::json out;
+    if (rpc.handler) {
+        rpc.handler(in, out);
+        return out;
+    }
+    segments buffer;
+    text_writer writer{buffer};
+    rpc.stream(in, writer);
+    std::string text;
+    for (auto& segment : buffer.release())
+        text += segment;
+    return nlohmann::json::parse(text);
+}
+
+asio::io_context& pool();
+int thread_count();
+
+// Runs f(0) .. f(count - 1) concurrently on the threads of the server. The calling thread takes part, so it only ever
+// waits for calls that are in progress, never for a thread that is busy with something else.
+void run_concurrently(std::size_t count, std::function<void(std::size_t)> f) {
+    struct state {
+        std::function<void(std::size_t)> f;
+        std::size_t count;
+        std::atomic<std::size_t> next = 0;
+        std::atomic<std::size_t> done = 0;
+    };
+    auto s = std::make_shared<state>(std::move(f), count);
+    auto work = [s] {
+        for (std::size_t i; (i = s->next++) < s->count; ) {
+            s->f(i);
+            if (++s->done == s->count)
+                s->done.notify_all();
+        }
+    };
+    for (std::size_t i = 1; i < std::min<std::size_t>(count, thread_count()); i++)
+        asio::post(pool(), work);
+    work();
+    for (std::size_t done; (done = s->done) != count; )
+        s->done.wait(done);
+}
+
+const rpc::key batch_key{method::post, "batch"};
+
+// Makes one call of a batch, as a request of its own would, and returns its status and result
+nlohmann::json batch_call(const nlohmann::json& call) {
+    auto result = [](http::status status, nlohmann::json body = {}) {
+        return body.is_null() ? nlohmann::json{{"status", int(status)}} : nlohmann::json{{"status", int(status)}, {"body", body}};
+    };
+    if (not call.is_object() or not call.contains("name") or not call["name"].is_string())
+        return result(http::status::bad_request, "A call needs a name");
+    rpc::key key;
+    auto method = call.contains("method") and call["method"].is_string() ? call["method"].get<std::string>() : "GET";
+         if (method == "GET") key.method = method::get;
+    else if (method == "POST") key.method = method::post;
+    else return result(http::status::bad_request, "Unsupported API method");
+    std::string_view name = call["name"].get_ref<const std::string&>();
+    auto query = std::min(name.find('?'), name.size());
+    key.name = name.substr(0, query);
+    if (key == batch_key)
+        return result(http::status::bad_request, "Batches cannot be nested");
+    auto rpc = registry::find(key);
+    if (not rpc)
+        return result(http::status::not_found, "The resource '/api/" + std::string{name} + "' was not found.");
+
+    try {
+        auto in = query < name.size() and key.method == method::get ? parse_query(name.substr(query + 1)) : call.value("body", nlohmann::json{});
+        auto out = invoke(*rpc, in);
+        return out.is_null() ? result(http::status::no_content) : result(http::status::ok, std::move(out));
+    } catch (std::exception& e) {
+        return result(http::status::bad_request, e.what());
+    }
+}
+
+// Makes the calls of POST /api/batch: [{"method": "GET", "name": "settings"}, {"method": "POST", "name": "settings",
+// "body": {...}}, ...]. POSTs are made in order. The GETs in between do not change anything, so they run concurrently.
+nlohmann::json run_batch(const nlohmann::json& calls) {
+    if (not calls.is_array())
+        throw std::invalid_argument("A batch is a list of calls");
+    auto is_get = [](const nlohmann::json& call) { return not call.is_object() or call.value("method", nlohmann::json{}) != "POST"; };
+    std::vector<nlohmann::json> results(calls.size());
+    for (std::size_t i = 0; i < calls.size(); ) {
+        auto end = i + 1;
+        if (is_get(calls[i]))
+            while (end < calls.size() and is_get(calls[end]))
+                end++;
+        if (end - i == 1)
+            results[i] = batch_call(calls[i]);
+        else
+            run_concurrently(end - i, [&](std::size_t j) { results[i + j] = batch_call(calls[i + j]); });
+        i = end;
+    }
+    return results;
+}
+
 template<class Body, class Allocator, class ResponseHandler>
 void handle_request(http::request<Body, http::basic_fields<Allocator>>&& req, ResponseHandler&& response_handler) {
     // Returns a bad request response
@@ -89,44 +544,67 @@ void handle_request(http::request<Body, http::basic_fields<Allocator>>&& req, Re
         response_handler(std::move(res));
     };
 
-    // Returns a server error response
-    auto const server_error =
-    [&](beast::string_view what) {
-        http::response<http::string_body> res{http::status::internal_server_error, req.version()};
-        res.set(http::field::server, http_server);
-        res.set(http::field::content_type, "text/html");
-        res.keep_alive(req.keep_alive());
-        res.body() = "An error occurred: '" + std::string(what) + "'";
-        res.prepare_payload();
-        response_handler(std::move(res));
-    };
-
     static constexpr const char* api_prefix = "/api/";
     if (req.target().starts_with(api_prefix)) {
         rpc::key key;
              if (req.method() == http::verb::get) key.method = method::get;
         else if (req.method() == http::verb::post) key.method = method::post;
         else return bad_request("Unsupported API method");
-        key.name = req.target().substr(std::strlen(api_prefix)).to_string();
-        auto reg = registry::lock();
-        auto it = reg->rpcs.find(key);
-        if (it == reg->rpcs.end())
+        std::string_view target{req.target().data(), req.target().size()};
+        auto query = std::min(target.find('?'), target.size());
+        key.name = target.substr(std::strlen(api_prefix), query - std::strlen(api_prefix));
+        auto rpc = key == batch_key ? nullptr : registry::find(key);
+        if (not rpc and key != batch_key)
             return not_found(req.target());
 
         nlohmann::json in;
         nlohmann::json out;
-        if (req[http::field::content_type] == "application/json") {
+        if (query < target.size() and key.method == method::get) {
+            in = parse_query(target.substr(query + 1));
+        } else if (auto f = find_format({req[http::field::content_type].data(), req[http::field::content_type].size()})) {
             try {
-                in = nlohmann::json::parse(req.body());
+                in = f->parse(req.body());
             } catch (nlohmann::json::exception& e) {
                 return bad_request(e.what());
             }
         } else if (not req[http::field::content_type].empty()) {
-            return bad_request("RPCs only understand input of Content-Type \"application/json\"");
+            return bad_request("RPCs only understand input of Content-Type \"application/json\", \"application/cbor\" or \"application/msgpack\"");
+        }
+
+        if (rpc and rpc->stream) {
+            // only JSON and CBOR can be written without knowing the sizes of arrays and objects up front
+            auto& f = negotiate({req[http::field::accept].data(), req[http::field::accept].size()});
+            bool cbor = f.mime_type == "application/cbor";
+            segments buffer;
+            try {
+                if (cbor) {
+                    cbor_writer writer{buffer};
+                    rpc->stream(in, writer);
+                } else {
+                    text_writer writer{buffer};
+                    rpc->stream(in, writer);
+                }
+            } catch (std::exception& e) {
+                return bad_request(e.what());
+            }
+            http::response<segmented_body> res{http::status::ok, req.version()};
+            res.set(http::field::server, http_server);
+            res.set(http::field::content_type, cbor ? "application/cbor" : "application/json");
+            res.set(http::field::vary, "Accept");
+            res.keep_alive(req.keep_alive());
+            res.body() = buffer.release();
+            if (res.body().size() > 1 and req.version() >= 11)
+                res.chunked(true);
+            else
+                res.prepare_payload();
+            return response_handler(std::move(res));
         }
 
         try {
-            it->second.handler(in, out);
+            if (rpc)
+                out = invoke(*rpc, in);
+            else
+                out = run_batch(in);
         } catch (std::exception& e) {
             return bad_request(e.what());
         }
@@ -137,16 +615,32 @@ void handle_request(http::request<Body, http::basic_fields<Allocator>>&& req, Re
             res.keep_alive(req.keep_alive());
             return response_handler(std::move(res));
         } else {
+            auto& f = negotiate({req[http::field::accept].data(), req[http::field::accept].size()});
             http::response<http::string_body> res{http::status::ok, req.version()};
             res.set(http::field::server, http_server);
-            res.set(http::field::content_type, "application/json");
+            res.set(http::field::content_type, beast::string_view{f.mime_type.data(), f.mime_type.size()});
+            res.set(http::field::vary, "Accept");
             res.keep_alive(req.keep_alive());
-            res.body() = out.dump();
+            f.serialize(out, res.body());
             res.prepare_payload();
             return response_handler(std::move(res));
         }
     }
 
+    if (req.method() == http::verb::get and req.target() == "/metrics") {
+        // rendered straight into the body, which is allocated once, at the size of the previous scrape
+        static std::atomic<std::size_t> size = 4096;
+        http::response<http::string_body> res{http::status::ok, req.version()};
+        res.set(http::field::server, http_server);
+        res.set(http::field::content_type, "text/plain; version=0.0.4; charset=utf-8");
+        res.keep_alive(req.keep_alive());
+        res.body().reserve(size + 256);
+        metrics::render(res.body());
+        size = res.body().size();
+        res.prepare_payload();
+        return response_handler(std::move(res));
+    }
+
     // Make sure we can handle the method
     if (req.method() != http::verb::get && req.method() != http::verb::head)
         return bad_request("Unsupported method");
@@ -155,48 +649,53 @@ void handle_request(http::request<Body, http::basic_fields<Allocator>>&& req, Re
     if (req.target().empty() || req.target()[0] != '/' || req.target().find("..") != beast::string_view::npos)
         return bad_request("Illegal request-target");
 
-    // Build the path to the requested file
-    std::string path = doc_root.get() + req.target().to_string();
-    if (req.target().back() == '/')
+    // Look up the requested file
+    std::string path = req.target().substr(0, req.target().find('?')).to_string();
+    if (path.back() == '/')
         path.append("index.html");
-
-    // Attempt to open the file
-    beast::error_code ec;
-    http::file_body::value_type body;
-    body.open(path.c_str(), beast::file_mode::scan, ec);
-
-    // Handle the case where the file doesn't exist
-    if (ec == beast::errc::no_such_file_or_directory)
+    auto asset = assets::find(path);
+    if (not asset)
         return not_found(req.target());
+    auto accept_encoding = req[http::field::accept_encoding];
+    auto& variant = asset->select({accept_encoding.data(), accept_encoding.size()});
 
-    // Handle an unknown error
-    if (ec)
-        return server_error(ec.message());
+    auto const set_fields = [&](auto& res) {
+        res.set(http::field::server, http_server);
+        res.set(http::field::etag, variant.etag);
+        res.set(http::field::cache_control, asset->cache_control);
+        res.set(http::field::vary, "Accept-Encoding");
+        res.keep_alive(req.keep_alive());
+    };
 
-    // Cache the size since we need it after the move
-    auto const size = body.size();
+    auto if_none_match = req[http::field::if_none_match];
+    if (matches({if_none_match.data(), if_none_match.size()}, variant.etag)) {
+        // The client has it already
+        http::response<http::empty_body> res{http::status::not_modified, req.version()};
+        set_fields(res);
+        return response_handler(std::move(res));
+    }
+
+    auto const set_content_fields = [&](auto& res) {
+        set_fields(res);
+        res.set(http::field::content_type, asset->mime_type);
+        if (not variant.encoding.empty())
+            res.set(http::field::content_encoding, variant.encoding);
+        res.content_length(variant.body->size());
+    };
 
     if (req.method() == http::verb::head) {
         // Respond to HEAD request
         http::response<http::empty_body> res{http::status::ok, req.version()};
-        res.set(http::field::server, http_server);
-        res.set(http::field::content_type, mime_type(path));
-        res.content_length(size);
-        res.keep_alive(req.keep_alive());
+        set_content_fields(res);
         return response_handler(std::move(res));
-    } else if (req.method() == http::verb::get) {
-        // Respond to GET request
-        http::response<http::file_body> res{
+    } else {
+        // Respond to GET request, without copying the cached body
+        http::response<shared_body> res{
             std::piecewise_construct,
-            std::make_tuple(std::move(body)),
+            std::make_tuple(variant.body),
             std::make_tuple(http::status::ok, req.version())};
-        res.set(http::field::server, http_server);
-        res.set(http::field::content_type, mime_type(path));
-        res.content_length(size);
-        res.keep_alive(req.keep_alive());
-        response_handler(std::move(res));
-    } else {
-        return bad_request("Unknown HTTP-method");
+        set_content_fields(res);
+        return response_handler(std::move(res));
     }
 }
 
@@ -205,6 +704,126 @@ void fail(beast::error_code ec, char const* what) {
     logferror("%s: %s", what, ec.message());
 }
 
+// JSON merge patch (RFC 7396) that turns from into to
+nlohmann::json merge_diff(const nlohmann::json& from, const nlohmann::json& to) {
+    if (not from.is_object() or not to.is_object())
+        return to;
+    nlohmann::json patch = nlohmann::json::object();
+    for (auto& [key, value] : to.items()) {
+        auto it = from.find(key);
+        if (it == from.end())
+            patch[key] = value;
+        else if (*it != value)
+            patch[key] = merge_diff(*it, value);
+    }
+    for (auto& [key, value] : from.items())
+        if (not to.contains(key))
+            patch[key] = nullptr;
+    return patch;
+}
+
+using event_message = std::shared_ptr<const std::string>;
+
+event_message make_event(const std::string& topic, const nlohmann::json& data) {
+    return std::make_shared<const std::string>("event: " + topic + "\ndata: " + data.dump() + "\n\n");
+}
+
+// Streams events to one client of GET /api/events, until the client goes away
+struct event_stream : public std::enable_shared_from_this<event_stream> {
+    static constexpr std::size_t max_queue = 64; // events; a client that lags further behind is dropped, it reconnects and resyncs
+
+    event_stream(beast::tcp_stream&& stream) : m_stream(std::move(stream)) {}
+
+    void run(unsigned version, std::vector<event_message> initial) {
+        http::response<http::empty_body> res{http::status::ok, version};
+        res.set(http::field::server, http_server);
+        res.set(http::field::content_type, "text/event-stream");
+        res.set(http::field::cache_control, "no-cache");
+        res.keep_alive(false); // the stream ends when the connection closes
+        m_queue.push_back(std::make_shared<const std::string>((std::ostringstream{} << res.base()).str()));
+        m_queue.insert(m_queue.end(), initial.begin(), initial.end());
+        do_write();
+
+        // the client never sends anything more, so a completed read means it closed the connection
+        m_stream.socket().async_read_some(asio::buffer(m_discard),
+                beast::bind_front_handler(&event_stream::on_read, shared_from_this()));
+    }
+
+    void push(const event_message& msg) {
+        asio::post(m_stream.get_executor(), [self = shared_from_this(), msg] {
+            if (self->m_closed)
+                return;
+            if (self->m_queue.size() >= max_queue) {
+                logfwarn("Dropping event stream client that does not keep up");
+                return self->close();
+            }
+            self->m_queue.push_back(msg);
+            if (self->m_queue.size() == 1)
+                self->do_write();
+        });
+    }
+
+private:
+    void do_write() {
+        m_stream.expires_after(30s);
+        asio::async_write(m_stream, asio::buffer(*m_queue.front()),
+                beast::bind_front_handler(&event_stream::on_write, shared_from_this()));
+    }
+
+    void on_write(beast::error_code ec, std::size_t) {
+        if (ec)
+            return close();
+        m_queue.pop_front();
+        if (not m_queue.empty())
+            do_write();
+    }
+
+    void on_read(beast::error_code, std::size_t) {
+        close();
+    }
+
+    void close();
+
+    beast::tcp_stream m_stream;
+    std::deque<event_message> m_queue; // front is being written
+    std::array<char, 64> m_discard;
+    bool m_closed = false;
+};
+
+struct events {
+    static auto lock() {
+        static mutex_protected<events> instance;
+        return instance.lock();
+    }
+
+    std::map<std::string, nlohmann::json> topics; // latest published state
+    std::vector<std::shared_ptr<event_stream>> subscribers;
+};
+
+void event_stream::close() {
+    if (m_closed)
+        return;
+    m_closed = true;
+    m_queue.clear();
+    beast::error_code ec;
+    m_stream.socket().shutdown(tcp::socket::shutdown_both, ec);
+    m_stream.socket().close(ec);
+    auto ev = events::lock();
+    std::erase(ev->subscribers, shared_from_this());
+}
+
+void subscribe(beast::tcp_stream&& stream, unsigned version) {
+    auto subscriber = std::make_shared<event_stream>(std::move(stream));
+    std::vector<event_message> initial;
+    {
+        auto ev = events::lock();
+        for (auto& [topic, state] : ev->topics)
+            initial.push_back(make_event(topic, state));
+        ev->subscribers.push_back(subscriber);
+    }
+    subscriber->run(version, std::move(initial)); // already on the strand of the connection
+}
+
 // Handles an HTTP server connection
 struct connection : public std::enable_shared_from_this<connection> {
     connection(tcp::socket&& socket) : m_stream(std::move(socket)) {}
@@ -230,9 +849,16 @@ struct connection : public std::enable_shared_from_this<connection> {
         if (ec)
             return fail(ec, "read");
 
+        // The connection becomes an event stream
+        if (m_req.method() == http::verb::get and m_req.target() == "/api/events")
+            return subscribe(std::move(m_stream), m_req.version());
+
         // Send the response
         handle_request(std::move(m_req), [spconn = shared_from_this()]<typename Response>(Response&& _response) {
             auto spresponse = std::make_shared<Response>(std::move(_response));
+            auto status_class = spresponse->result_int() / 100;
+            if (status_class >= 1 and status_class <= 5)
+                http_requests[status_class - 1].inc();
             spconn->m_spresponse = spresponse;
             bool keep_alive = spresponse->keep_alive();
             http::async_write(spconn->m_stream, *spresponse,
@@ -305,11 +931,22 @@ config::param<asio::ip::address, ip_parser> bind_address{"www.bind_address", asi
 config::param<uint16_t> bind_port{"www.bind_port", 8008};
 config::param<std::string> service_name{"www.service_name", "p1faker"};
 
+config::param<int> threads{"www.threads", 0}; // 0 for one per core
+
+int thread_count() {
+    return threads > 0 ? threads.get() : std::max(1, int(std::thread::hardware_concurrency()));
+}
+
+// Runs the io_context on a pool of threads, so that a slow request does not hold up the others.
+// Each connection has its own strand, so its handlers never run concurrently.
 struct server {
     server() {
         try {
             std::make_shared<listener>(m_ioc, tcp::endpoint{bind_address, bind_port})->run();
-            m_thread = std::thread{[&] { m_ioc.run(); }};
+            assets::watch(m_ioc);
+            for (int i = 0; i < thread_count(); i++)
+                m_threads.emplace_back([&] { m_ioc.run(); });
+            logfdebug("Serving http with %d threads", m_threads.size());
         } catch (boost::system::system_error& e) {
             logferror("Failed to set up www server: %s", e.what());
         }
@@ -317,17 +954,35 @@ struct server {
 
     ~server() {
         m_ioc.stop();
-        if (m_thread.joinable())
-            m_thread.join();
+        for (auto& thread : m_threads)
+            thread.join();
     }
 
-    asio::io_context m_ioc;
-    std::thread m_thread;
+    asio::io_context m_ioc{thread_count()};
+    std::vector<std::thread> m_threads;
     service_discovery::publisher m_publisher{"_http._tcp", service_name.get(), bind_port.get()};
 } _server;
 
+asio::io_context& pool() {
+    return _server.m_ioc;
+}
+
 } // anonymous namespace
 
+void www::publish(const std::string& topic, const nlohmann::json& state) {
+    auto ev = events::lock();
+    auto& previous = ev->topics[topic];
+    if (previous == state)
+        return;
+    auto patch = merge_diff(previous, state);
+    previous = state;
+    if (ev->subscribers.empty())
+        return;
+    auto msg = make_event(topic, patch);
+    for (auto& subscriber : ev->subscribers)
+        subscriber->push(msg);
+}
+
 std::ostream& www::method::operator<<(std::ostream& os, method::type v) {
     static auto labels = {"GET", "POST"};
     return os << *(labels.begin() + v);
@@ -338,26 +993,52 @@ std::ostream& www::operator<<(std::ostream& os, rpc::key key) {
 }
 
 void rpc::init(std::function<void(const nlohmann::json&, nlohmann::json&)> handler) {
-    auto reg = registry::lock();
-    auto it = reg->rpcs.find(m_key);
-    logfdebug("%s RPC %s", it == reg->rpcs.end() ? "Register" : "Overrule", m_key);
-    if (it != reg->rpcs.end()) reg->rpcs.erase(it);
-    reg->rpcs.emplace(m_key, rpc_value{this, handler});
+    registry::add(m_key, std::make_shared<rpc_entry>(this, std::move(handler)));
+}
+
+void rpc::init_stream(std::function<void(const nlohmann::json&, json_writer&)> stream) {
+    registry::add(m_key, std::make_shared<rpc_entry>(this, nullptr, std::move(stream)));
+}
+
+void json_writer::value(const nlohmann::json& j) {
+    switch (j.type()) {
+    case nlohmann::json::value_t::object:
+        begin_object();
+        for (auto& [k, v] : j.items()) {
+            key(k);
+            value(v);
+        }
+        return end_object();
+    case nlohmann::json::value_t::array:
+        begin_array();
+        for (auto& v : j)
+            value(v);
+        return end_array();
+    case nlohmann::json::value_t::string: return value(std::string_view{j.get_ref<const std::string&>()});
+    case nlohmann::json::value_t::boolean: return value(j.get<bool>());
+    case nlohmann::json::value_t::number_integer: return value(j.get<int64_t>());
+    case nlohmann::json::value_t::number_unsigned: return value(int64_t(j.get<uint64_t>()));
+    case nlohmann::json::value_t::number_float: return value(j.get<double>());
+    default: return null();
+    }
 }
 
 void rpc::move(rpc& src) {
     auto reg = registry::lock();
-    auto it = reg->rpcs.find(m_key);
-    if (it == reg->rpcs.end()) return;
-    if (it->second.instance != &src) return;
-    it->second.instance = this;
+    auto entry = reg->get(m_key);
+    if (entry and entry->instance == &src)
+        entry->instance = this; // only used under the lock, so no need to publish a new table
 }
 
 rpc::~rpc() {
-    auto reg = registry::lock();
-    auto it = reg->rpcs.find(m_key);
-    if (it == reg->rpcs.end()) return;
-    if (it->second.instance != this) return; // this RPC might have been overruled in the meantime, so no guarantee that we find ourselves.
-    logfdebug("Unregister RPC %s", m_key);
-    reg->rpcs.erase(it);
+    std::shared_ptr<rpc_entry> entry;
+    {
+        auto reg = registry::lock();
+        entry = reg->get(m_key);
+        if (not entry or entry->instance != this) return; // this RPC might have been overruled in the meantime, so no guarantee that we find ourselves.
+        logfdebug("Unregister RPC %s", m_key);
+        reg->modify([&](registry::table& tbl) { tbl.erase(m_key); });
+        entry->retired = true;
+    }
+    registry::drain(*entry);
 }
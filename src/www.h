@@ -2,7 +2,9 @@
 #define WWW_H_
 
 #include <nlohmann/json.hpp>
+#include <cstdint>
 #include <functional>
+#include <string_view>
 
 namespace www {
 
@@ -14,6 +16,31 @@ enum type {
 std::ostream& operator<<(std::ostream& os, type v);
 }
 
+/**
+ * Writes a response piece by piece, straight into the buffers that are sent, instead of building a nlohmann::json
+ * first. Keys and values of an object alternate, as in JSON. The encoding (JSON or CBOR) is up to the client.
+ */
+class json_writer {
+public:
+    virtual ~json_writer() = default;
+
+    virtual void begin_object() = 0;
+    virtual void end_object() = 0;
+    virtual void begin_array() = 0;
+    virtual void end_array() = 0;
+    virtual void key(std::string_view) = 0;
+    virtual void value(std::string_view) = 0;
+    virtual void value(double) = 0; // NaN and infinity become null in JSON
+    virtual void value(int64_t) = 0;
+    virtual void value(bool) = 0;
+    virtual void null() = 0;
+
+    void value(const char* s) { value(std::string_view{s}); }
+    void value(float v) { value(double(v)); }
+    void value(int v) { value(int64_t(v)); }
+    void value(const nlohmann::json&); // for the small parts of a response
+};
+
 class rpc {
 public:
     struct key {
@@ -33,6 +60,20 @@ public:
         return result;
     }
 
+    /**
+     * Register unary handler for GET-request, which takes the parameters in the query string.
+     * The type of the argument needs to be specified as template argument.
+     * It is deserialized from a JSON object with a member per parameter: a number if the value is one, a string otherwise.
+     * Return value is serialized to JSON in response body. */
+    template<typename Request, typename F>
+    static rpc get(std::string name, F&& handler) {
+        rpc result{key{method::get, name}};
+        result.init([handler](const nlohmann::json& in, nlohmann::json& out) {
+            out = handler(in.is_null() ? nlohmann::json::object().get<Request>() : in.get<Request>());
+        });
+        return result;
+    }
+
     /**
      * Register unary handler for POST-request.
      * The type of the argument needs to be specified as template argument
@@ -47,6 +88,19 @@ public:
         return result;
     }
 
+    /**
+     * Register unary handler for GET-request that writes its response with a json_writer, for responses that are too
+     * large to build as nlohmann::json first. Large responses are sent with chunked transfer encoding.
+     * The argument is taken from the query string, as for get<Request>. */
+    template<typename Request, typename F>
+    static rpc stream(std::string name, F&& handler) {
+        rpc result{key{method::get, name}};
+        result.init_stream([handler](const nlohmann::json& in, json_writer& out) {
+            handler(in.is_null() ? nlohmann::json::object().get<Request>() : in.get<Request>(), out);
+        });
+        return result;
+    }
+
     rpc() = default;
     rpc(rpc&& r) : m_key(r.m_key) { move(r); }
     rpc& operator=(rpc&& r) { m_key = r.m_key; move(r); return *this; }
@@ -57,11 +111,20 @@ public:
 private:
     rpc(key k) : m_key{k} {}
     void init(std::function<void(const nlohmann::json&, nlohmann::json&)>);
+    void init_stream(std::function<void(const nlohmann::json&, json_writer&)>);
     void move(rpc& src);
     key m_key;
 };
 std::ostream& operator<<(std::ostream& os, rpc::key key);
 
+/**
+ * Publish the latest state of a topic to the clients of GET /api/events (server-sent events), instead of letting them
+ * poll an RPC. Only what changed since the previous publication is sent, as a JSON merge patch (RFC 7396) in an event
+ * named after the topic, and nothing at all if nothing changed. New clients first get the complete state of every
+ * topic. The event is serialized once and the same buffer is written to all clients.
+ */
+void publish(const std::string& topic, const nlohmann::json& state);
+
 }
 
 #endif /* WWW_H_ */